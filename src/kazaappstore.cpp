@@ -0,0 +1,193 @@
+#include "kazaappstore.h"
+#include "kazabinarydelta.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThreadPool>
+#include <QDateTime>
+#include <QCryptographicHash>
+
+KaZaAppStore::KaZaAppStore(QObject *parent)
+    : QObject{parent}
+{
+}
+
+void KaZaAppStore::setPath(const QString &path, int keep)
+{
+    m_path = path;
+    m_keep = qMax(1, keep);
+    if(!QDir().mkpath(m_path))
+    {
+        qWarning() << "Can't create application store" << m_path;
+        m_path.clear();
+    }
+}
+
+QString KaZaAppStore::key(const QString &checksum)
+{
+    // The base64 checksum may contain '/', use hex in file names
+    return QString::fromLatin1(QByteArray::fromBase64(checksum.toLatin1()).toHex());
+}
+
+QString KaZaAppStore::versionPath(const QString &checksum) const
+{
+    if(m_path.isEmpty() || checksum.isEmpty()) return QString();
+
+    const QString path = m_path + "/" + key(checksum) + ".rcc";
+    return QFile::exists(path) ? path : QString();
+}
+
+QString KaZaAppStore::archive(const QString &file)
+{
+    if(m_path.isEmpty()) return QString();
+
+    // Copy first then hash the copy: the archived bytes always match the
+    // checksum they are named after, even if the source is being rewritten
+    const QString tmp = m_path + "/release.tmp";
+    QFile::remove(tmp);
+    if(!QFile::copy(file, tmp))
+    {
+        qWarning() << "Can't archive application release" << file;
+        return QString();
+    }
+    QString checksum;
+    QFile copy(tmp);
+    if(copy.open(QFile::ReadOnly))
+    {
+        QCryptographicHash hash(QCryptographicHash::Algorithm::Md5);
+        if(hash.addData(&copy))
+        {
+            checksum = hash.result().toBase64();
+        }
+        copy.close();
+    }
+    if(checksum.isEmpty())
+    {
+        QFile::remove(tmp);
+        return QString();
+    }
+
+    const QString path = m_path + "/" + key(checksum) + ".rcc";
+    if(!QFile::exists(path))
+    {
+        if(!QFile::rename(tmp, path))
+        {
+            qWarning() << "Can't archive application release" << path;
+            QFile::remove(tmp);
+            return checksum;
+        }
+        qInfo() << "Archived application release" << path;
+    }
+    else
+    {
+        QFile::remove(tmp);
+        // Mark it as the latest release for pruning
+        QFile release(path);
+        if(release.open(QFile::ReadWrite))
+        {
+            release.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+        }
+    }
+    prune(checksum);
+    return checksum;
+}
+
+void KaZaAppStore::prune(const QString &current)
+{
+    QDir dir(m_path);
+    const QFileInfoList releases = dir.entryInfoList(QStringList() << "*.rcc", QDir::Files, QDir::Time);
+    QSet<QString> kept;
+    for(qsizetype i = 0; i < releases.size(); ++i)
+    {
+        if(i < m_keep)
+        {
+            kept.insert(releases[i].completeBaseName());
+        }
+        else
+        {
+            QFile::remove(releases[i].absoluteFilePath());
+        }
+    }
+
+    // Only deltas to the current release are ever served
+    const QString target = key(current);
+    const QFileInfoList deltas = dir.entryInfoList(QStringList() << "*.delta", QDir::Files);
+    for(const QFileInfo &delta: deltas)
+    {
+        const QStringList ends = delta.completeBaseName().split('-');
+        if(ends.size() != 2 || ends[1] != target || !kept.contains(ends[0]))
+        {
+            QFile::remove(delta.absoluteFilePath());
+        }
+    }
+}
+
+void KaZaAppStore::delta(const QString &from, const QString &to, QObject *context, DeltaCallback callback)
+{
+    const QString basePath = versionPath(from);
+    const QString targetPath = versionPath(to);
+    if(basePath.isEmpty() || targetPath.isEmpty())
+    {
+        callback(QString());
+        return;
+    }
+
+    const QString deltaPath = m_path + "/" + key(from) + "-" + key(to) + ".delta";
+    if(m_useless.contains(deltaPath))
+    {
+        callback(QString());
+        return;
+    }
+    if(QFile::exists(deltaPath))
+    {
+        callback(deltaPath);
+        return;
+    }
+
+    // Several clients of the same release share one delta computation
+    const bool running = m_pending.contains(deltaPath);
+    m_pending[deltaPath].append(qMakePair(QPointer<QObject>(context), callback));
+    if(running) return;
+
+    QPointer<KaZaAppStore> self(this);
+    QThreadPool::globalInstance()->start([self, basePath, targetPath, deltaPath]() {
+        const bool created = KaZaBinaryDelta::createFile(basePath, targetPath, deltaPath);
+        if(self)
+        {
+            QMetaObject::invokeMethod(self, [self, deltaPath, created]() {
+                if(self) self->deltaReady(deltaPath, created);
+            }, Qt::QueuedConnection);
+        }
+    });
+}
+
+void KaZaAppStore::deltaReady(const QString &deltaPath, bool created)
+{
+    QString path;
+    if(created)
+    {
+        const QStringList ends = QFileInfo(deltaPath).completeBaseName().split('-');
+        const qint64 deltaSize = QFileInfo(deltaPath).size();
+        const qint64 targetSize = QFileInfo(m_path + "/" + ends.value(1) + ".rcc").size();
+        if(deltaSize < targetSize)
+        {
+            qInfo() << "Application delta" << deltaPath << ":" << deltaSize << "bytes for" << targetSize;
+            path = deltaPath;
+        }
+        else
+        {
+            QFile::remove(deltaPath);
+            m_useless.insert(deltaPath);
+        }
+    }
+
+    const QList<QPair<QPointer<QObject>, DeltaCallback>> waiting = m_pending.take(deltaPath);
+    for(const auto &request: waiting)
+    {
+        if(request.first)
+        {
+            request.second(path);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef KAZAAPPSTORE_H
+#define KAZAAPPSTORE_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QPointer>
+#include <QSet>
+#include <functional>
+
+/**
+ * @brief Archive of the client application releases and of the deltas between them
+ *
+ * Every release is copied as <hex checksum>.rcc in the store directory, the
+ * last ones are kept. Deltas from an archived release to the current one are
+ * built on demand on the thread pool and cached as <from>-<to>.delta.
+ * Checksums are the base64 MD5 sent to clients in APP:.
+ */
+class KaZaAppStore : public QObject
+{
+    Q_OBJECT
+public:
+    using DeltaCallback = std::function<void(const QString &deltaPath)>;
+
+    explicit KaZaAppStore(QObject *parent = nullptr);
+
+    /**
+     * @param path Store directory (e.g., /var/lib/kazad/app), created if needed
+     * @param keep Number of releases kept
+     */
+    void setPath(const QString &path, int keep);
+
+    /**
+     * @brief Archive a release, if not done yet, and drop the oldest ones
+     *
+     * The file is copied first and the copy is hashed, so the archived
+     * release always matches its checksum.
+     *
+     * @return Checksum of the archived copy, empty if it can't be archived
+     */
+    QString archive(const QString &file);
+
+    /**
+     * @brief Path of an archived release, empty if unknown
+     */
+    QString versionPath(const QString &checksum) const;
+
+    /**
+     * @brief Get the delta between two archived releases
+     *
+     * The callback is called once the delta is available, with an empty path if
+     * there is none (unknown release, or a delta not smaller than the release).
+     * It is not called if the context object is destroyed meanwhile.
+     */
+    void delta(const QString &from, const QString &to, QObject *context, DeltaCallback callback);
+
+private:
+    static QString key(const QString &checksum);
+    void prune(const QString &current);
+    void deltaReady(const QString &deltaPath, bool created);
+
+    QString m_path;
+    int m_keep {5};
+    QHash<QString, QList<QPair<QPointer<QObject>, DeltaCallback>>> m_pending;  // delta path -> waiting requests
+    QSet<QString> m_useless;        // deltas not smaller than their target
+};
+
+#endif // KAZAAPPSTORE_H
@@ -0,0 +1,157 @@
+#include "kazabinarydelta.h"
+#include <QDebug>
+#include <QFile>
+#include <QHash>
+#include <QSaveFile>
+#include <cstring>
+
+namespace {
+
+/**
+ * @brief rsync style rolling checksum over a BlockSize window
+ */
+struct RollingChecksum
+{
+    quint32 a {0};
+    quint32 b {0};
+
+    void reset(const uchar *data)
+    {
+        a = 0;
+        b = 0;
+        for(qsizetype i = 0; i < KaZaBinaryDelta::BlockSize; ++i)
+        {
+            a += data[i];
+            b += quint32(KaZaBinaryDelta::BlockSize - i) * data[i];
+        }
+    }
+
+    void roll(uchar out, uchar in)
+    {
+        a += in - out;
+        b += a - quint32(KaZaBinaryDelta::BlockSize) * out;
+    }
+
+    quint32 value() const { return (a & 0xFFFF) | (b << 16); }
+};
+
+}
+
+void KaZaBinaryDelta::appendVarint(QByteArray &out, quint64 value)
+{
+    while(value >= 0x80)
+    {
+        out.append(char((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+QByteArray KaZaBinaryDelta::create(const char *base, qsizetype baseSize,
+                                   const char *target, qsizetype targetSize)
+{
+    const uchar *src = reinterpret_cast<const uchar*>(base);
+    const uchar *dst = reinterpret_cast<const uchar*>(target);
+
+    QByteArray delta("KZD1");
+    appendVarint(delta, targetSize);
+
+    // Index the blocks of the base, the first occurrence of a checksum wins
+    QHash<quint32, qsizetype> blocks;
+    blocks.reserve(baseSize / BlockSize);
+    RollingChecksum checksum;
+    for(qsizetype offset = 0; offset + BlockSize <= baseSize; offset += BlockSize)
+    {
+        checksum.reset(src + offset);
+        if(!blocks.contains(checksum.value()))
+        {
+            blocks.insert(checksum.value(), offset);
+        }
+    }
+
+    auto insert = [&](qsizetype from, qsizetype to) {
+        if(to <= from) return;
+        delta.append(char(Insert));
+        appendVarint(delta, to - from);
+        delta.append(target + from, to - from);
+    };
+
+    qsizetype pos = 0;
+    qsizetype literal = 0;      // start of the bytes not encoded yet
+    if(targetSize >= BlockSize)
+    {
+        checksum.reset(dst);
+    }
+    while(pos + BlockSize <= targetSize)
+    {
+        auto it = blocks.constFind(checksum.value());
+        if(it != blocks.cend() && std::memcmp(src + it.value(), dst + pos, BlockSize) == 0)
+        {
+            qsizetype from = it.value();
+            qsizetype length = BlockSize;
+            while(pos + length < targetSize && from + length < baseSize && src[from + length] == dst[pos + length])
+            {
+                length++;
+            }
+            // Take back the matching bytes already queued as literal
+            while(pos > literal && from > 0 && src[from - 1] == dst[pos - 1])
+            {
+                from--;
+                pos--;
+                length++;
+            }
+
+            insert(literal, pos);
+            delta.append(char(Copy));
+            appendVarint(delta, from);
+            appendVarint(delta, length);
+
+            pos += length;
+            literal = pos;
+            if(pos + BlockSize <= targetSize)
+            {
+                checksum.reset(dst + pos);
+            }
+            continue;
+        }
+
+        if(pos + BlockSize < targetSize)
+        {
+            checksum.roll(dst[pos], dst[pos + BlockSize]);
+        }
+        pos++;
+    }
+    insert(literal, targetSize);
+    return delta;
+}
+
+bool KaZaBinaryDelta::createFile(const QString &basePath, const QString &targetPath, const QString &deltaPath)
+{
+    QFile base(basePath);
+    QFile target(targetPath);
+    if(!base.open(QFile::ReadOnly) || !target.open(QFile::ReadOnly))
+    {
+        qWarning() << "Can't open delta sources" << basePath << targetPath;
+        return false;
+    }
+
+    // Empty files can't be mapped
+    const uchar *baseData = base.size() ? base.map(0, base.size()) : nullptr;
+    const uchar *targetData = target.size() ? target.map(0, target.size()) : nullptr;
+    if((base.size() && !baseData) || (target.size() && !targetData))
+    {
+        qWarning() << "Can't map delta sources" << basePath << targetPath;
+        return false;
+    }
+
+    const QByteArray delta = create(reinterpret_cast<const char*>(baseData), base.size(),
+                                    reinterpret_cast<const char*>(targetData), target.size());
+
+    QSaveFile out(deltaPath);
+    if(!out.open(QFile::WriteOnly) || out.write(delta) != delta.size() || !out.commit())
+    {
+        qWarning() << "Can't write delta" << deltaPath << ":" << out.errorString();
+        return false;
+    }
+    return true;
+}
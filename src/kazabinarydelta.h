@@ -0,0 +1,54 @@
+#ifndef KAZABINARYDELTA_H
+#define KAZABINARYDELTA_H
+
+#include <QByteArray>
+#include <QString>
+
+/**
+ * @brief Binary delta between two versions of a file
+ *
+ * The base is indexed by fixed size blocks; the target is scanned with a
+ * rolling checksum, and every block also found in the base is extended as far
+ * as the bytes match and encoded as a copy from the base. Remaining bytes are
+ * inserted literally. Unchanged resources of a rebuilt rcc are copies even if
+ * they moved in the file.
+ *
+ * Format:
+ * - "KZD1" magic, then varint target size
+ * - operations until the end of the delta:
+ *   - 0x00 varint length, followed by length literal bytes (insert)
+ *   - 0x01 varint base offset, varint length (copy from the base)
+ *
+ * Varints are unsigned LEB128 (7 bits per byte, least significant first).
+ */
+class KaZaBinaryDelta
+{
+public:
+    static constexpr qsizetype BlockSize = 64;
+
+    enum Operation : quint8 {
+        Insert = 0x00,
+        Copy = 0x01
+    };
+
+    /**
+     * @brief Delta turning base into target
+     */
+    static QByteArray create(const char *base, qsizetype baseSize,
+                             const char *target, qsizetype targetSize);
+
+    /**
+     * @brief Write the delta between two files
+     *
+     * Both files are memory mapped; the delta is written atomically, so a
+     * reader never sees a partial delta file.
+     *
+     * @return false if a file can't be read or the delta can't be written
+     */
+    static bool createFile(const QString &basePath, const QString &targetPath, const QString &deltaPath);
+
+private:
+    static void appendVarint(QByteArray &out, quint64 value);
+};
+
+#endif // KAZABINARYDELTA_H
@@ -1,8 +1,10 @@
 #include "kazacertificategenerator.h"
 #include <QDebug>
-#include <QDateTime>
+#include <QFile>
+#include <QRandomGenerator>
 
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <openssl/pem.h>
@@ -17,18 +19,137 @@ QString KaZaCertificateGenerator::getLastOpenSSLError()
     return QString::fromUtf8(err);
 }
 
+/**
+ * @brief Name of a key algorithm, for logs
+ */
+static const char *keyAlgorithmName(KaZaCertificateGenerator::KeyAlgorithm algorithm)
+{
+    switch (algorithm) {
+    case KaZaCertificateGenerator::EcdsaP256:
+        return "P-256 ECDSA";
+    case KaZaCertificateGenerator::Ed25519:
+        return "Ed25519";
+    default:
+        return "RSA";
+    }
+}
+
+/**
+ * @brief Digest used to sign with a key
+ *
+ * Ed25519 hashes internally and must be used with a NULL digest.
+ */
+static const EVP_MD *signingDigest(EVP_PKEY *key)
+{
+    return EVP_PKEY_id(key) == EVP_PKEY_ED25519 ? NULL : EVP_sha256();
+}
+
+KaZaCertificateGenerator::KeyAlgorithm KaZaCertificateGenerator::keyAlgorithm(const QString &name, bool *ok)
+{
+    const QString algorithm = name.trimmed().toLower();
+    if (ok) *ok = true;
+    if (algorithm == "ecdsa" || algorithm == "p256" || algorithm == "p-256") {
+        return EcdsaP256;
+    }
+    if (algorithm == "ed25519") {
+        return Ed25519;
+    }
+    if (ok && !algorithm.isEmpty() && algorithm != "rsa") {
+        *ok = false;
+    }
+    return Rsa;
+}
+
+QSslKey KaZaCertificateGenerator::loadPrivateKey(const QString &path, const QByteArray &password)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        qWarning() << "Couldn't open private key:" << file.errorString();
+        return QSslKey();
+    }
+    const QByteArray pem = file.readAll();
+
+    BIO *bio = BIO_new_mem_buf(pem.constData(), pem.size());
+    if (!bio) {
+        qWarning() << "Failed to create BIO:" << getLastOpenSSLError();
+        return QSslKey();
+    }
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, NULL, NULL, (void*)password.constData());
+    BIO_free(bio);
+    if (!key) {
+        qWarning() << "Failed to read private key" << path << ":" << getLastOpenSSLError();
+        return QSslKey();
+    }
+
+    QSsl::KeyAlgorithm algorithm;
+    switch (EVP_PKEY_id(key)) {
+    case EVP_PKEY_RSA:
+        algorithm = QSsl::Rsa;
+        break;
+    case EVP_PKEY_EC:
+        algorithm = QSsl::Ec;
+        break;
+    default:
+        // Not supported by QSslKey: hand the OpenSSL key over (QSslKey takes ownership)
+        return QSslKey(reinterpret_cast<Qt::HANDLE>(key), QSsl::PrivateKey);
+    }
+    EVP_PKEY_free(key);
+    return QSslKey(pem, algorithm, QSsl::Pem, QSsl::PrivateKey, password);
+}
+
+EVP_PKEY *KaZaCertificateGenerator::generateKey(KeyAlgorithm algorithm, int rsaBits)
+{
+    int type = EVP_PKEY_RSA;
+    if (algorithm == EcdsaP256) type = EVP_PKEY_EC;
+    if (algorithm == Ed25519) type = EVP_PKEY_ED25519;
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(type, NULL);
+    if (!ctx) {
+        qCritical() << "Failed to create EVP_PKEY_CTX:" << getLastOpenSSLError();
+        return nullptr;
+    }
+
+    if (EVP_PKEY_keygen_init(ctx) <= 0) {
+        qCritical() << "Failed to initialize keygen:" << getLastOpenSSLError();
+        EVP_PKEY_CTX_free(ctx);
+        return nullptr;
+    }
+
+    if (algorithm == Rsa && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, rsaBits) <= 0) {
+        qCritical() << "Failed to set key bits:" << getLastOpenSSLError();
+        EVP_PKEY_CTX_free(ctx);
+        return nullptr;
+    }
+
+    if (algorithm == EcdsaP256 && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) <= 0) {
+        qCritical() << "Failed to set curve:" << getLastOpenSSLError();
+        EVP_PKEY_CTX_free(ctx);
+        return nullptr;
+    }
+
+    EVP_PKEY *key = NULL;
+    if (EVP_PKEY_keygen(ctx, &key) <= 0) {
+        qCritical() << "Failed to generate key:" << getLastOpenSSLError();
+        EVP_PKEY_CTX_free(ctx);
+        return nullptr;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
 bool KaZaCertificateGenerator::generateCertificates(const QString &hostname,
                                                      const QString &keyPassword,
-                                                     const QString &basePath)
+                                                     const QString &basePath,
+                                                     KeyAlgorithm algorithm)
 {
-    qInfo() << "Generating SSL certificates using OpenSSL library...";
+    qInfo() << "Generating SSL certificates using OpenSSL library (" << keyAlgorithmName(algorithm) << "keys)...";
 
-    if (!generateCAKeyAndCert(hostname, basePath)) {
+    if (!generateCAKeyAndCert(hostname, basePath, algorithm)) {
         qCritical() << "Failed to generate CA certificate";
         return false;
     }
 
-    if (!generateServerKeyAndCert(hostname, keyPassword, basePath)) {
+    if (!generateServerKeyAndCert(hostname, keyPassword, basePath, algorithm)) {
         qCritical() << "Failed to generate server certificate";
         return false;
     }
@@ -44,38 +165,18 @@ bool KaZaCertificateGenerator::generateCertificates(const QString &hostname,
 bool KaZaCertificateGenerator::generateClientCertificate(const QString &username,
                                                           const QString &userPassword,
                                                           const QString &hostname,
-                                                          const QString &basePath)
+                                                          const QString &basePath,
+                                                          KeyAlgorithm algorithm)
 {
     qInfo() << "Generating client certificate for user:" << username;
 
-    // Generate RSA key pair (2048-bit)
-    qInfo() << "Generating client private key (2048-bit RSA, encrypted)...";
-
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-    if (!ctx) {
-        qCritical() << "Failed to create EVP_PKEY_CTX:" << getLastOpenSSLError();
-        return false;
-    }
-
-    if (EVP_PKEY_keygen_init(ctx) <= 0) {
-        qCritical() << "Failed to initialize keygen:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
-
-    if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0) {
-        qCritical() << "Failed to set key bits:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
+    qInfo() << "Generating client private key (" << keyAlgorithmName(algorithm) << ")...";
 
-    EVP_PKEY *client_key = NULL;
-    if (EVP_PKEY_keygen(ctx, &client_key) <= 0) {
-        qCritical() << "Failed to generate client key:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY *client_key = generateKey(algorithm, 2048);
+    if (!client_key) {
+        qCritical() << "Failed to generate client key";
         return false;
     }
-    EVP_PKEY_CTX_free(ctx);
 
     // Save client private key
     // Android doesn't support PBES2 encryption (OpenSSL 3.0 default)
@@ -153,8 +254,8 @@ bool KaZaCertificateGenerator::generateClientCertificate(const QString &username
     // Set version (X509 v3)
     X509_set_version(client_cert, 2);
 
-    // Set serial number (use timestamp for uniqueness)
-    ASN1_INTEGER_set(X509_get_serialNumber(client_cert), (long)QDateTime::currentSecsSinceEpoch());
+    // Set serial number (random: several certificates can be generated in the same second)
+    ASN1_INTEGER_set_uint64(X509_get_serialNumber(client_cert), QRandomGenerator::system()->generate64() >> 1);
 
     // Set validity period (10 years = 3650 days)
     X509_gmtime_adj(X509_get_notBefore(client_cert), 0);
@@ -217,8 +318,8 @@ bool KaZaCertificateGenerator::generateClientCertificate(const QString &username
         X509_EXTENSION_free(ext);
     }
 
-    // Sign certificate with CA private key using SHA-256
-    if (!X509_sign(client_cert, ca_key, EVP_sha256())) {
+    // Sign certificate with CA private key using SHA-256 (Ed25519: intrinsic digest)
+    if (!X509_sign(client_cert, ca_key, signingDigest(ca_key))) {
         qCritical() << "Failed to sign client certificate:" << getLastOpenSSLError();
         X509_free(client_cert);
         EVP_PKEY_free(client_key);
@@ -264,36 +365,16 @@ bool KaZaCertificateGenerator::generateClientCertificate(const QString &username
 }
 
 bool KaZaCertificateGenerator::generateCAKeyAndCert(const QString &hostname,
-                                                     const QString &basePath)
+                                                     const QString &basePath,
+                                                     KeyAlgorithm algorithm)
 {
-    qInfo() << "Generating CA private key (4096-bit RSA)...";
-
-    // Generate RSA key pair (4096-bit)
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-    if (!ctx) {
-        qCritical() << "Failed to create EVP_PKEY_CTX:" << getLastOpenSSLError();
-        return false;
-    }
-
-    if (EVP_PKEY_keygen_init(ctx) <= 0) {
-        qCritical() << "Failed to initialize keygen:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
+    qInfo() << "Generating CA private key (" << keyAlgorithmName(algorithm) << ")...";
 
-    if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 4096) <= 0) {
-        qCritical() << "Failed to set key bits:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
-
-    EVP_PKEY *ca_key = NULL;
-    if (EVP_PKEY_keygen(ctx, &ca_key) <= 0) {
-        qCritical() << "Failed to generate CA key:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY *ca_key = generateKey(algorithm, 4096);
+    if (!ca_key) {
+        qCritical() << "Failed to generate CA key";
         return false;
     }
-    EVP_PKEY_CTX_free(ctx);
 
     // Save CA private key (unencrypted - stored securely in /var/lib/kazad)
     QString keyPath = basePath + "/ca.key";
@@ -376,8 +457,8 @@ bool KaZaCertificateGenerator::generateCAKeyAndCert(const QString &hostname,
         X509_EXTENSION_free(ext);
     }
 
-    // Sign the certificate with SHA-256
-    if (!X509_sign(ca_cert, ca_key, EVP_sha256())) {
+    // Sign the certificate with SHA-256 (Ed25519: intrinsic digest)
+    if (!X509_sign(ca_cert, ca_key, signingDigest(ca_key))) {
         qCritical() << "Failed to sign CA certificate:" << getLastOpenSSLError();
         X509_free(ca_cert);
         EVP_PKEY_free(ca_key);
@@ -413,37 +494,17 @@ bool KaZaCertificateGenerator::generateCAKeyAndCert(const QString &hostname,
 
 bool KaZaCertificateGenerator::generateServerKeyAndCert(const QString &hostname,
                                                          const QString &keyPassword,
-                                                         const QString &basePath)
+                                                         const QString &basePath,
+                                                         KeyAlgorithm algorithm)
 {
-    qInfo() << "Generating server private key (2048-bit RSA, encrypted)...";
+    qInfo() << "Generating server private key (" << keyAlgorithmName(algorithm) << ", encrypted)...";
 
-    // Generate RSA key pair (2048-bit)
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-    if (!ctx) {
-        qCritical() << "Failed to create EVP_PKEY_CTX:" << getLastOpenSSLError();
+    EVP_PKEY *server_key = generateKey(algorithm, 2048);
+    if (!server_key) {
+        qCritical() << "Failed to generate server key";
         return false;
     }
 
-    if (EVP_PKEY_keygen_init(ctx) <= 0) {
-        qCritical() << "Failed to initialize keygen:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
-
-    if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0) {
-        qCritical() << "Failed to set key bits:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
-
-    EVP_PKEY *server_key = NULL;
-    if (EVP_PKEY_keygen(ctx, &server_key) <= 0) {
-        qCritical() << "Failed to generate server key:" << getLastOpenSSLError();
-        EVP_PKEY_CTX_free(ctx);
-        return false;
-    }
-    EVP_PKEY_CTX_free(ctx);
-
     // Save server private key (encrypted with DES3-CBC)
     QString keyPath = basePath + "/server.key";
     FILE *keyFile = fopen(keyPath.toUtf8().constData(), "wb");
@@ -555,8 +616,10 @@ bool KaZaCertificateGenerator::generateServerKeyAndCert(const QString &hostname,
     }
 
     // Key Usage: Digital Signature, Key Encipherment (critical)
+    // Key encipherment only applies to RSA keys
     ext = X509V3_EXT_conf_nid(NULL, &ctx_v3, NID_key_usage,
-                              "critical,digitalSignature,keyEncipherment");
+                              algorithm == Rsa ? "critical,digitalSignature,keyEncipherment"
+                                               : "critical,digitalSignature");
     if (ext) {
         X509_add_ext(server_cert, ext, -1);
         X509_EXTENSION_free(ext);
@@ -593,8 +656,8 @@ bool KaZaCertificateGenerator::generateServerKeyAndCert(const QString &hostname,
         X509_EXTENSION_free(ext);
     }
 
-    // Sign certificate with CA private key using SHA-256
-    if (!X509_sign(server_cert, ca_key, EVP_sha256())) {
+    // Sign certificate with CA private key using SHA-256 (Ed25519: intrinsic digest)
+    if (!X509_sign(server_cert, ca_key, signingDigest(ca_key))) {
         qCritical() << "Failed to sign server certificate:" << getLastOpenSSLError();
         X509_free(server_cert);
         EVP_PKEY_free(server_key);
@@ -2,13 +2,20 @@
 #define KAZACERTIFICATEGENERATOR_H
 
 #include <QString>
+#include <QSslKey>
+
+typedef struct evp_pkey_st EVP_PKEY;
 
 /**
  * @brief Certificate generator using OpenSSL C API
  *
  * Generates SSL certificates for mutual TLS authentication:
- * - CA certificate (self-signed, 4096-bit RSA, 10 years)
- * - Server certificate (signed by CA, 2048-bit RSA, 10 years)
+ * - CA certificate (self-signed, 10 years)
+ * - Server certificate (signed by CA, 10 years)
+ *
+ * Keys are 4096-bit (CA) / 2048-bit RSA, P-256 ECDSA or Ed25519. Elliptic
+ * curve keys are generated in milliseconds and make each TLS handshake far
+ * cheaper than RSA on small ARM boards.
  *
  * Certificates include proper X.509v3 extensions for:
  * - Certificate Authority (CA:TRUE, keyCertSign, cRLSign)
@@ -18,23 +25,52 @@
 class KaZaCertificateGenerator
 {
 public:
+    enum KeyAlgorithm {
+        Rsa,
+        EcdsaP256,
+        Ed25519
+    };
+
+    /**
+     * @brief Parse a key algorithm name as used in kazad.conf ("rsa", "ecdsa", "ed25519")
+     *
+     * @param name Algorithm name (case insensitive)
+     * @param ok Set to false if the name is unknown (Rsa is then returned)
+     * @return Key algorithm
+     */
+    static KeyAlgorithm keyAlgorithm(const QString &name, bool *ok = nullptr);
+
+    /**
+     * @brief Load a PEM private key whatever its algorithm
+     *
+     * RSA and ECDSA keys are loaded as regular QSslKey. Ed25519 keys, which
+     * QSslKey can't parse, are loaded with OpenSSL and wrapped as an opaque key.
+     *
+     * @param path PEM private key file
+     * @param password Password of an encrypted key
+     * @return Key, null on failure
+     */
+    static QSslKey loadPrivateKey(const QString &path, const QByteArray &password);
+
     /**
      * @brief Generate all required SSL certificates (CA and server)
      *
      * @param hostname Hostname for certificate CN and SAN fields
      * @param keyPassword Password to encrypt server private key
      * @param basePath Directory to store certificates (e.g., /var/lib/kazad)
+     * @param algorithm Algorithm of the CA and server keys
      * @return true if all certificates generated successfully, false otherwise
      */
     static bool generateCertificates(const QString &hostname,
                                      const QString &keyPassword,
-                                     const QString &basePath);
+                                     const QString &basePath,
+                                     KeyAlgorithm algorithm = Rsa);
 
     /**
      * @brief Generate client certificate signed by CA
      *
      * Creates:
-     * - <username>.key: 2048-bit RSA private key (unencrypted PKCS#8 for Android compatibility)
+     * - <username>.key: private key (unencrypted PKCS#8 for Android compatibility)
      * - <username>.csr: Certificate signing request
      * - <username>.cert.pem: Client certificate signed by CA (10 years)
      *
@@ -48,19 +84,30 @@ public:
      * @param userPassword Password to encrypt client private key (currently unused)
      * @param hostname Hostname from server configuration
      * @param basePath Directory to store certificates (e.g., /var/lib/kazad)
+     * @param algorithm Algorithm of the client key (the CA key signs whatever its own algorithm)
      * @return true on success, false on failure
      */
     static bool generateClientCertificate(const QString &username,
                                           const QString &userPassword,
                                           const QString &hostname,
-                                          const QString &basePath);
+                                          const QString &basePath,
+                                          KeyAlgorithm algorithm = Rsa);
 
 private:
+    /**
+     * @brief Generate a private key
+     *
+     * @param algorithm Key algorithm
+     * @param rsaBits Key size, only used for RSA
+     * @return Key to free with EVP_PKEY_free, nullptr on failure
+     */
+    static EVP_PKEY *generateKey(KeyAlgorithm algorithm, int rsaBits);
+
     /**
      * @brief Generate CA private key and self-signed certificate
      *
      * Creates:
-     * - ca.key: 4096-bit RSA private key (unencrypted)
+     * - ca.key: private key, 4096 bits if RSA (unencrypted)
      * - ca.cert.pem: Self-signed CA certificate (10 years)
      *
      * Certificate subject: CN=<hostname> CA, O=KaZa, C=FR
@@ -68,16 +115,18 @@ private:
      *
      * @param hostname Hostname for CA certificate CN
      * @param basePath Directory to store files
+     * @param algorithm Key algorithm
      * @return true on success, false on failure
      */
     static bool generateCAKeyAndCert(const QString &hostname,
-                                     const QString &basePath);
+                                     const QString &basePath,
+                                     KeyAlgorithm algorithm);
 
     /**
      * @brief Generate server private key and certificate signed by CA
      *
      * Creates:
-     * - server.key: 2048-bit RSA private key (encrypted with DES3)
+     * - server.key: private key, 2048 bits if RSA (encrypted with DES3)
      * - server.cert.pem: Server certificate signed by CA (10 years)
      *
      * Certificate subject: CN=<hostname>, O=KaZa, C=FR
@@ -86,11 +135,13 @@ private:
      * @param hostname Hostname for server certificate CN and SAN
      * @param keyPassword Password to encrypt server private key
      * @param basePath Directory to store files
+     * @param algorithm Key algorithm
      * @return true on success, false on failure
      */
     static bool generateServerKeyAndCert(const QString &hostname,
                                          const QString &keyPassword,
-                                         const QString &basePath);
+                                         const QString &basePath,
+                                         KeyAlgorithm algorithm);
 
     /**
      * @brief Get last OpenSSL error message
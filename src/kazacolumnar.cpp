@@ -0,0 +1,211 @@
+#include "kazacolumnar.h"
+#include <QDataStream>
+#include <QDateTime>
+#include <QHash>
+#include <QtEndian>
+#include <cstring>
+
+void KaZaColumnar::appendVarint(QByteArray &out, quint64 value)
+{
+    while(value >= 0x80)
+    {
+        out.append(char((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+void KaZaColumnar::appendZigzag(QByteArray &out, quint64 value)
+{
+    // Two's complement value: sign bit spread without signed shifts
+    appendVarint(out, (value << 1) ^ (0 - (value >> 63)));
+}
+
+KaZaColumnar::Type KaZaColumnar::columnType(const QMetaType &type)
+{
+    switch(type.id())
+    {
+    case QMetaType::Bool:
+        return Bool;
+    case QMetaType::Int:
+    case QMetaType::UInt:
+    case QMetaType::Short:
+    case QMetaType::UShort:
+    case QMetaType::Long:
+    case QMetaType::LongLong:
+    case QMetaType::Char:
+    case QMetaType::SChar:
+    case QMetaType::UChar:
+        return Int;
+    case QMetaType::Double:
+    case QMetaType::Float:
+        return Double;
+    case QMetaType::QDateTime:
+        return Timestamp;
+    case QMetaType::QString:
+        return String;
+    case QMetaType::QByteArray:
+        return Bytes;
+    default:
+        return Variant;
+    }
+}
+
+QByteArray KaZaColumnar::encode(const QStringList &columns, const QList<QMetaType> &types,
+                                const QList<QList<QVariant>> &rows)
+{
+    QByteArray out("KZC1");
+    appendVarint(out, rows.size());
+    appendVarint(out, columns.size());
+
+    for(int column = 0; column < columns.size(); ++column)
+    {
+        const QByteArray name = columns[column].toUtf8();
+        appendVarint(out, name.size());
+        out.append(name);
+
+        // Declared type, else the type of the first value
+        QMetaType metaType = types.value(column);
+        if(!metaType.isValid())
+        {
+            for(const QList<QVariant> &row: rows)
+            {
+                if(!row.value(column).isNull())
+                {
+                    metaType = row.value(column).metaType();
+                    break;
+                }
+            }
+        }
+        const Type type = columnType(metaType);
+        out.append(char(type));
+
+        QByteArray nulls((rows.size() + 7) / 8, 0);
+        bool hasNull = false;
+        for(qsizetype i = 0; i < rows.size(); ++i)
+        {
+            if(rows[i].value(column).isNull())
+            {
+                nulls[i / 8] = char(nulls[i / 8] | (1 << (i % 8)));
+                hasNull = true;
+            }
+        }
+        out.append(char(hasNull ? 1 : 0));
+        if(hasNull)
+        {
+            out.append(nulls);
+        }
+
+        encodeColumn(out, type, rows, column);
+    }
+    return out;
+}
+
+void KaZaColumnar::encodeColumn(QByteArray &out, Type type, const QList<QList<QVariant>> &rows, int column)
+{
+    switch(type)
+    {
+    case Bool:
+    {
+        QByteArray bits;
+        qsizetype count = 0;
+        for(const QList<QVariant> &row: rows)
+        {
+            const QVariant value = row.value(column);
+            if(value.isNull()) continue;
+            if(count % 8 == 0) bits.append(char(0));
+            if(value.toBool()) bits.back() = char(bits.back() | (1 << (count % 8)));
+            count++;
+        }
+        out.append(bits);
+        break;
+    }
+    case Int:
+    case Timestamp:
+    {
+        // Wrapping difference: far apart values don't overflow
+        quint64 previous = 0;
+        for(const QList<QVariant> &row: rows)
+        {
+            const QVariant value = row.value(column);
+            if(value.isNull()) continue;
+            const quint64 current = quint64(type == Timestamp ? value.toDateTime().toMSecsSinceEpoch() : value.toLongLong());
+            appendZigzag(out, current - previous);
+            previous = current;
+        }
+        break;
+    }
+    case Double:
+    {
+        for(const QList<QVariant> &row: rows)
+        {
+            const QVariant value = row.value(column);
+            if(value.isNull()) continue;
+            const double d = value.toDouble();
+            quint64 bits;
+            std::memcpy(&bits, &d, sizeof(bits));
+            const quint64 le = qToLittleEndian(bits);
+            out.append(reinterpret_cast<const char*>(&le), sizeof(le));
+        }
+        break;
+    }
+    case String:
+    {
+        QHash<QString, quint32> dictionary;
+        QStringList entries;
+        QList<quint32> indexes;
+        for(const QList<QVariant> &row: rows)
+        {
+            const QVariant value = row.value(column);
+            if(value.isNull()) continue;
+            const QString text = value.toString();
+            auto it = dictionary.constFind(text);
+            if(it == dictionary.cend())
+            {
+                it = dictionary.insert(text, entries.size());
+                entries.append(text);
+            }
+            indexes.append(it.value());
+        }
+        appendVarint(out, entries.size());
+        for(const QString &entry: std::as_const(entries))
+        {
+            const QByteArray utf8 = entry.toUtf8();
+            appendVarint(out, utf8.size());
+            out.append(utf8);
+        }
+        for(quint32 index: std::as_const(indexes))
+        {
+            appendVarint(out, index);
+        }
+        break;
+    }
+    case Bytes:
+    {
+        for(const QList<QVariant> &row: rows)
+        {
+            const QVariant value = row.value(column);
+            if(value.isNull()) continue;
+            const QByteArray data = value.toByteArray();
+            appendVarint(out, data.size());
+            out.append(data);
+        }
+        break;
+    }
+    case Variant:
+    {
+        for(const QList<QVariant> &row: rows)
+        {
+            const QVariant value = row.value(column);
+            if(value.isNull()) continue;
+            QByteArray data;
+            QDataStream stream(&data, QIODevice::WriteOnly);
+            stream.setVersion(QDataStream::Qt_6_0);
+            stream << value;
+            appendVarint(out, data.size());
+            out.append(data);
+        }
+        break;
+    }
+    }
+}
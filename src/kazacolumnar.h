@@ -0,0 +1,63 @@
+#ifndef KAZACOLUMNAR_H
+#define KAZACOLUMNAR_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMetaType>
+#include <QStringList>
+#include <QVariant>
+
+/**
+ * @brief Column oriented, typed encoding of a DB query result
+ *
+ * Each column is sent once with its type, its values packed together:
+ * time series (timestamp + double columns) take a few bytes per row instead
+ * of two type tagged QVariants.
+ *
+ * Format (varints are unsigned LEB128, zigzag for signed values):
+ * - "KZC1", varint row count, varint column count
+ * - per column: varint name size, UTF-8 name, type byte, null byte (0: no
+ *   null, 1: followed by a null bitmap of (rows + 7) / 8 bytes, bit set for
+ *   null, least significant bit first), then the values of the non null rows:
+ *   - Bool: bitmap, one bit per value
+ *   - Int: zigzag varint of the difference with the previous value (the first
+ *     with 0), computed on 64-bit two's complement and wrapping: the decoder
+ *     adds it to the previous value modulo 2^64. Unsigned 64-bit columns
+ *     (ULong, ULongLong) don't fit a signed value and are sent as Variant
+ *   - Double: IEEE 754 little endian, 8 bytes per value
+ *   - Timestamp: ms since epoch (UTC), encoded like Int
+ *   - String: varint dictionary size, dictionary entries (varint size, UTF-8),
+ *     then a varint dictionary index per value
+ *   - Bytes: varint size and data per value
+ *   - Variant: varint size and QDataStream (Qt 6.0) serialized QVariant per value
+ */
+class KaZaColumnar
+{
+public:
+    enum Type : quint8 {
+        Bool = 1,
+        Int = 2,
+        Double = 3,
+        Timestamp = 4,
+        String = 5,
+        Bytes = 6,
+        Variant = 7
+    };
+
+    /**
+     * @param columns Column names
+     * @param types Declared column types (from the query record), may be shorter than columns
+     * @param rows Result rows
+     */
+    static QByteArray encode(const QStringList &columns, const QList<QMetaType> &types,
+                             const QList<QList<QVariant>> &rows);
+
+    static Type columnType(const QMetaType &type);
+
+private:
+    static void appendVarint(QByteArray &out, quint64 value);
+    static void appendZigzag(QByteArray &out, quint64 value);
+    static void encodeColumn(QByteArray &out, Type type, const QList<QList<QVariant>> &rows, int column);
+};
+
+#endif // KAZACOLUMNAR_H
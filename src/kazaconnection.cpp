@@ -2,12 +2,16 @@
 #include "kazamanager.h"
 #include "kazaobject.h"
 #include "kzalarm.h"
+#include "kazadispatcher.h"
+#include "kazacolumnar.h"
 #include <QTcpSocket>
+#include <QSslSocket>
 #include <QFile>
 #include <QTimer>
 #include <QBuffer>
-#include <QSqlQuery>
-#include <QSqlRecord>
+#include <QDataStream>
+#include <QRandomGenerator>
+#include <limits>
 
 
 QString KaZaConnection::user() const
@@ -15,9 +19,26 @@ QString KaZaConnection::user() const
     return m_user;
 }
 
+void KaZaConnection::setUser(const QString &user)
+{
+    if(user == m_user) return;
+    const QString previous = m_user;
+    m_user = user;
+    KaZaManager::connectionUserChanged(this, previous);
+}
+
+QString KaZaConnection::recipient() const
+{
+    // Tabs and new lines would break the notification store records
+    QString device = m_devicename;
+    device.replace('\t', ' ').replace('\n', ' ');
+    return m_user.toLower() + "/" + device + "/" + QString::number(m_channel);
+}
+
 KaZaConnection::KaZaConnection(QTcpSocket *socket, QObject *parent)
     : QObject{parent}
     , m_protocol(socket)
+    , m_socket(socket)
 {
 #ifdef DEBUG_CONNECTION
     qDebug().noquote().nospace() << "SSL " << id() << ": Connected";
@@ -33,6 +54,24 @@ KaZaConnection::KaZaConnection(QTcpSocket *socket, QObject *parent)
     QObject::connect(&m_protocol, &KaZaProtocol::frameDbQuery, this, &KaZaConnection::_processFrameDbQuery);
     QObject::connect(&m_protocol, &KaZaProtocol::frameSocketConnect, this, &KaZaConnection::_processFrameSocketConnect);
     QObject::connect(&m_protocol, &KaZaProtocol::frameSocketData, this, &KaZaConnection::_processFrameSocketData);
+
+    m_batchTimer.setSingleShot(true);
+    QObject::connect(&m_batchTimer, &QTimer::timeout, this, &KaZaConnection::_flushPendingValues);
+    m_throttleTimer.setSingleShot(true);
+    QObject::connect(&m_throttleTimer, &QTimer::timeout, this, &KaZaConnection::_flushThrottledValues);
+    m_clock.start();
+
+    // Outbound queue limits: collapse object updates above the watermark,
+    // disconnect if the socket buffer still grows above the budget
+    m_highWatermark = KaZaManager::setting("protocol/highwatermark").toLongLong();
+    if (m_highWatermark <= 0) {
+        m_highWatermark = 256 * 1024;
+    }
+    m_sendBudget = KaZaManager::setting("protocol/sendbudget").toLongLong();
+    if (m_sendBudget <= 0) {
+        m_sendBudget = 32 * 1024 * 1024;
+    }
+    QObject::connect(m_socket, &QIODevice::bytesWritten, this, &KaZaConnection::_socketBytesWritten);
 }
 
 quint16 KaZaConnection::id() {
@@ -40,34 +79,66 @@ quint16 KaZaConnection::id() {
 }
 
 void KaZaConnection::sendNotify(QString text) {
-    qInfo() << "Notify " << m_user << ": " << text;
+#ifdef DEBUG_CONNECTION
+    qDebug().noquote().nospace() << idlog() << ": Notify " << text;
+#endif
     m_protocol.sendCommand("NOTIFY:" + text);
+    checkSendBudget();
+}
+
+void KaZaConnection::sendNotifyBatch(const QList<KaZaNotificationQueue::Notification> &notifications)
+{
+    // NOTIFYBATCH:<count>:<last seq>:<base64 qCompress'd QDataStream of (qint64 ms since epoch, QString message)>,
+    // kept queued until the client answers NOTIFYACK:<last seq>
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    for(const KaZaNotificationQueue::Notification &notification: notifications)
+    {
+        stream << notification.time << notification.message;
+    }
+    m_protocol.sendCommand("NOTIFYBATCH:" + QString::number(notifications.size()) + ":" + QString::number(notifications.last().seq)
+                           + ":" + QString::fromLatin1(qCompress(data).toBase64()));
+    checkSendBudget();
+}
+
+void KaZaConnection::sendAppChecksum(const QString &checksum)
+{
+    // Clients learn the checksum at negotiation, don't send it before
+    if(!m_valid) return;
+    m_protocol.sendCommand("APP:" + checksum);
+}
+
+void KaZaConnection::sendAlarmFrame(const QString &frame)
+{
+    if(!m_alarmsSubscribed) return;
+    m_protocol.sendCommand(frame);
+    checkSendBudget();
 }
 
 void KaZaConnection::askPosition()
 {
-    qInfo() << "Ask position " << m_user;
+#ifdef DEBUG_CONNECTION
+    qDebug().noquote().nospace() << idlog() << ": Ask position";
+#endif
     m_protocol.sendCommand("POSITION?");
 }
 
 void KaZaConnection::sendObjectsList()
 {
-    // Build QMap from ALL objects in KaZaManager (not just subscribed ones)
-    QMap<QString, QPair<QVariant, QString>> objects;
-    QStringList objectKeys = KaZaManager::getObjectKeys();
-
-    for (const QString &key : objectKeys) {
-        KaZaObject *obj = KaZaManager::getObject(key);
-        if (obj) {
-            objects[key] = QPair<QVariant, QString>(obj->value(), obj->unit());
-        }
+    // ALL objects in KaZaManager (not just subscribed ones), cached by the
+    // manager and only rebuilt when an object or a value changed
+    if (m_sharedFrames) {
+        // OBJLIST:<generation>:<base64 qCompress QDataStream map>, compressed once for all clients
+        m_protocol.sendCommand("OBJLIST:" + QString::number(KaZaManager::generation()) + ":" + KaZaManager::objectsListBlob());
+    } else {
+        // Send compressed objects list via protocol
+        m_protocol.sendFrameObjectsList(KaZaManager::objectsList());
     }
-
-    // Send compressed objects list via protocol
-    m_protocol.sendFrameObjectsList(objects);
+    checkSendBudget();
 }
 
-void KaZaConnection::enableDMZ()
+void KaZaConnection::enableDMZ(int interval)
 {
     if (m_dmzEnabled) {
         qInfo().noquote().nospace() << idlog() << ": DMZ already enabled";
@@ -76,32 +147,74 @@ void KaZaConnection::enableDMZ()
 
     qInfo().noquote().nospace() << idlog() << ": Enabling DMZ - subscribing to all objects";
     m_dmzEnabled = true;
+    m_dmzInterval = interval;
 
-    // Subscribe to all existing objects
-    QStringList objectKeys = KaZaManager::getObjectKeys();
-    quint16 index = 0;
-    for (const QString &name : objectKeys) {
-        KaZaObject *obj = KaZaManager::getObject(name);
-        if (obj && !m_obj.contains(name)) {
-            subscribeToObject(obj, index++, false);
+    // Subscribe to all existing objects, in LISTOBJECTS order
+    const QList<KaZaObject*> &objects = KaZaManager::objects();
+    for (qsizetype objectId = 0; objectId < objects.size(); ++objectId) {
+        KaZaObject *obj = objects[objectId];
+        if (obj && clientIndex(objectId) < 0) {
+            subscribeDmz(obj, objectId, false);
         }
     }
 
-    qInfo().noquote().nospace() << "SSL " << id() << ": DMZ enabled - subscribed to " << m_obj.size() << " objects";
+    qInfo().noquote().nospace() << "SSL " << id() << ": DMZ enabled - subscribed to " << m_subscriptions << " objects";
 }
 
-void KaZaConnection::subscribeToObject(KaZaObject *obj, quint16 index, bool sendDesc)
+quint16 KaZaConnection::dmzIndex(quint16 objectId)
 {
-    if (!obj) return;
+    // Clients knowing the server ids (OBJIDS?) get them as index, the others
+    // the object position in LISTOBJECTS, as before persistent ids
+    return m_objectIdIndexes ? objectId : quint16(m_dmzNextIndex++);
+}
 
-    QString name = obj->name();
-    if (m_obj.contains(name)) {
-        return; // Already subscribed
+void KaZaConnection::subscribeDmz(KaZaObject *obj, quint16 objectId, bool sendDesc)
+{
+    const quint16 wanted = dmzIndex(objectId);
+    if (!m_inbound.value(wanted)) {
+        subscribeToObject(obj, wanted, sendDesc, m_dmzInterval);
+        return;
+    }
+    // The index is already used by an object the client registered itself
+    subscribeToMatch(obj, wanted, m_dmzInterval);
+}
+
+qint32 KaZaConnection::freeIndex(quint16 preferred) const
+{
+    if (!m_inbound.value(preferred)) {
+        return preferred;
+    }
+    const qint32 hole = qint32(m_inbound.indexOf(nullptr));
+    if (hole >= 0) {
+        return hole;
+    }
+    return m_inbound.size() <= std::numeric_limits<quint16>::max() ? qint32(m_inbound.size()) : -1;
+}
+
+bool KaZaConnection::subscribeToObject(KaZaObject *obj, quint16 index, bool sendDesc, int interval)
+{
+    if (!obj) return false;
+
+    KaZaObject *current = m_inbound.value(index);
+    if (current && current != obj) {
+        qWarning().noquote().nospace() << idlog() << ": Index " << index << " already used by " << current->name()
+                                       << ", can't subscribe to " << obj->name();
+        return false;
+    }
+
+    qint32 objectId = KaZaManager::objectId(obj);
+    if (objectId < 0 || !KaZaManager::dispatcher()->subscribe(objectId, this, index)) {
+        return false; // Unknown object or already subscribed
     }
 
-    m_obj[name] = obj;
-    m_ids[name] = index;
-    QObject::connect(obj, &KaZaObject::valueChanged, this, &KaZaConnection::_objectChanged);
+    if (index >= m_inbound.size()) {
+        m_inbound.resize(index + 1);
+    }
+    m_inbound[index] = obj;
+    m_subscriptions++;
+    setThrottle(index, interval);
+
+    QString name = obj->name();
 
     // Only send OBJDESC if client hasn't already received the objects list
     // (OBJLIST already contains name, value, and unit for all objects)
@@ -112,16 +225,399 @@ void KaZaConnection::subscribeToObject(KaZaObject *obj, quint16 index, bool send
     // Send initial value only if objects list wasn't sent
     // (OBJLIST already contains current values)
     if (sendDesc && obj->value().isValid()) {
-        m_protocol.sendObject(index, obj->value(), false);
+        sendObjectValue(index, KaZaEncodedValue(obj->value()));
+    }
+    return true;
+}
+
+void KaZaConnection::subscribeToPattern(const QString &pattern, int interval)
+{
+    KaZaNamePattern compiled(pattern);
+    if (!compiled.isValid()) {
+        qWarning().noquote().nospace() << idlog() << ": Invalid subscription pattern " << pattern;
+        m_protocol.sendCommand("SUB:ERROR:" + pattern);
+        return;
+    }
+    m_patterns.append(PatternSubscription{compiled, interval});
+
+    const QList<KaZaObject*> matches = KaZaManager::matchObjects(compiled);
+    for (KaZaObject *obj : matches) {
+        subscribeToMatch(obj, KaZaManager::objectId(obj), interval);
+    }
+
+    qInfo().noquote().nospace() << idlog() << ": Subscribed to " << pattern << " (" << matches.size() << " objects)";
+    m_protocol.sendCommand("SUB:OK:" + pattern);
+}
+
+void KaZaConnection::objectRegistered(KaZaObject *obj, quint16 index)
+{
+    if (m_dmzEnabled) {
+        if (clientIndex(index) < 0) {
+            subscribeDmz(obj, index, true);
+        }
+        return;
+    }
+
+    const QString name = obj->name();
+    for (const PatternSubscription &subscription : std::as_const(m_patterns)) {
+        if (subscription.pattern.matches(name)) {
+            subscribeToMatch(obj, index, subscription.interval);
+            return;
+        }
+    }
+}
+
+void KaZaConnection::subscribeToMatch(KaZaObject *obj, quint16 objectId, int interval)
+{
+    if (clientIndex(objectId) >= 0) {
+        return; // Already subscribed, keep the client index
+    }
+
+    // The client did not choose the index, tell it which one it got: the
+    // object id, or a free index when the client already uses that one
+    const qint32 index = freeIndex(objectId);
+    if (index < 0 || !subscribeToObject(obj, quint16(index), false, interval)) {
+        qWarning().noquote().nospace() << idlog() << ": No index left for " << obj->name();
+        return;
+    }
+    m_protocol.sendCommand("OBJSUB:" + obj->name() + ":" + QString::number(index) + ":" + obj->unit());
+    if (obj->value().isValid()) {
+        sendObjectValue(index, KaZaEncodedValue(obj->value()));
+    }
+}
+
+void KaZaConnection::unsubscribeFromObject(KaZaObject *obj, quint16 objectId)
+{
+    qint32 index = clientIndex(objectId);
+    if (index < 0) return;
+
+    KaZaManager::dispatcher()->unsubscribe(objectId, this);
+    if (m_inbound.value(index) == obj) {
+        m_inbound[index] = nullptr;
+    }
+    m_subscriptions--;
+    m_throttles.remove(index);
+}
+
+void KaZaConnection::setThrottle(quint16 index, int interval)
+{
+    if (interval <= 0) {
+        m_throttles.remove(index);
+        return;
+    }
+    auto it = m_throttles.find(index);
+    if (it == m_throttles.end()) {
+        m_throttles.insert(index, Throttle{interval});
+    } else {
+        it->interval = interval;
+    }
+}
+
+void KaZaConnection::sendObjectValue(quint16 index, const KaZaEncodedValue &value)
+{
+#ifdef DEBUG_CONNECTION
+    qDebug() << "sendObjectValue " << index << value.value();
+#endif
+    auto it = m_throttles.find(index);
+    if (it != m_throttles.end()) {
+        const qint64 now = m_clock.elapsed();
+        const qint64 next = it->lastSent + it->interval;
+        if (it->lastSent >= 0 && now < next) {
+            // Too early: hold back, the latest value is sent when the interval ends
+            it->pending = true;
+            it->value = value;
+            if (!m_throttleTimer.isActive() || m_throttleTimer.remainingTime() > next - now) {
+                m_throttleTimer.start(int(next - now));
+            }
+            return;
+        }
+        it->lastSent = now;
+        it->pending = false;
+        it->value = KaZaEncodedValue();
+    }
+    writeObjectValue(index, value);
+}
+
+void KaZaConnection::_flushThrottledValues()
+{
+    const qint64 now = m_clock.elapsed();
+    qint64 wait = -1;
+    for (auto it = m_throttles.begin(); it != m_throttles.end(); ++it) {
+        if (!it->pending) continue;
+
+        const qint64 next = it->lastSent + it->interval;
+        if (now >= next) {
+            const KaZaEncodedValue value = it->value;
+            it->lastSent = now;
+            it->pending = false;
+            it->value = KaZaEncodedValue();
+            writeObjectValue(it.key(), value);
+        } else if (wait < 0 || next - now < wait) {
+            wait = next - now;
+        }
+    }
+    if (wait >= 0) {
+        m_throttleTimer.start(int(wait));
+    }
+}
+
+void KaZaConnection::writeObjectValue(quint16 index, const KaZaEncodedValue &value)
+{
+    if (m_batchWindow >= 0 || isCongested()) {
+        // Keep only the latest value of each object until it can be sent
+        if (m_batchWindow >= 0) {
+            value.encoded(); // Encode in the shared value, not in our copy
+        }
+        auto it = m_pendingValues.find(index);
+        if (it == m_pendingValues.end()) {
+            m_pendingValues.insert(index, value);
+            m_pendingOrder.append(index);
+        } else {
+            it.value() = value;
+            if (m_congested) {
+                m_collapsedUpdates++;
+            }
+        }
+
+        if (m_congested) {
+            checkSendBudget();
+        } else if (!m_batchTimer.isActive()) {
+            m_batchTimer.start(m_batchWindow);
+        }
+        return;
+    }
+    sendValueFrame(index, value);
+    checkSendBudget();
+}
+
+void KaZaConnection::sendValueFrame(quint16 index, const KaZaEncodedValue &value)
+{
+    m_protocol.sendObject(index, value.value(), false);
+}
+
+void KaZaConnection::_flushPendingValues()
+{
+    if (m_congested) {
+        return; // Flushed when the socket drains
+    }
+
+    if (m_batchWindow < 0) {
+        for (quint16 index : std::as_const(m_pendingOrder)) {
+            sendValueFrame(index, m_pendingValues.value(index));
+        }
+        m_pendingValues.clear();
+        m_pendingOrder.clear();
+        return;
+    }
+
+    // UPD:<index>:<value>:<index>:<value>... split in frames of bounded size,
+    // a single value larger than the bound going alone in its frame
+    static constexpr qsizetype maxFrameSize = 60000;
+    QString frame;
+    for (quint16 index : std::as_const(m_pendingOrder)) {
+        const QString entry = ":" + QString::number(index) + ":" + m_pendingValues.value(index).encoded();
+        if (!frame.isEmpty() && frame.size() + entry.size() > maxFrameSize) {
+            m_protocol.sendCommand(frame);
+            frame.clear();
+        }
+        if (frame.isEmpty()) {
+            frame = "UPD";
+        }
+        frame += entry;
+    }
+    if (!frame.isEmpty()) {
+        m_protocol.sendCommand(frame);
+    }
+    m_pendingValues.clear();
+    m_pendingOrder.clear();
+    checkSendBudget();
+}
+
+qint64 KaZaConnection::outboundBytes() const
+{
+    qint64 bytes = m_socket->bytesToWrite();
+    QSslSocket *sslSocket = qobject_cast<QSslSocket*>(m_socket);
+    if (sslSocket) {
+        bytes += sslSocket->encryptedBytesToWrite();
+    }
+    return bytes;
+}
+
+bool KaZaConnection::checkSendBudget()
+{
+    // Called after every write path: whatever was queued (values, DB results,
+    // files, proxied data...), a client that doesn't read is dropped
+    if (m_overBudget) {
+        return false;
+    }
+    if (outboundBytes() > m_sendBudget) {
+        qWarning().noquote().nospace() << idlog() << ": Send budget exceeded (" << outboundBytes() << " bytes pending), disconnecting";
+        m_overBudget = true;
+        // Deferred: the manager removes the connection from its client list,
+        // which may be being iterated by the caller (value, alarm, list fan-out)
+        QMetaObject::invokeMethod(this, [this]() {
+            m_socket->abort();
+            emit disconnectFromHost();
+        }, Qt::QueuedConnection);
+        return false;
+    }
+    isCongested();
+    return true;
+}
+
+bool KaZaConnection::isCongested()
+{
+    if (!m_congested && outboundBytes() > m_highWatermark) {
+        qInfo().noquote().nospace() << idlog() << ": Slow connection (" << outboundBytes() << " bytes pending), collapsing object updates";
+        m_congested = true;
+    }
+    return m_congested;
+}
+
+void KaZaConnection::_socketBytesWritten()
+{
+    if (m_congested && outboundBytes() <= m_highWatermark / 2) {
+        m_congested = false;
+        _flushPendingValues();
+        // Proxied sockets paused while congested
+        for (QTcpSocket *sock : std::as_const(m_sockets)) {
+            if (sock->bytesAvailable() > 0) {
+                forwardSocketData(sock);
+            }
+        }
+    }
+    pumpStream();
+    checkSendBudget();
+    if (!m_dbCredits.isEmpty() && outboundBytes() <= m_highWatermark / 2) {
+        KaZaDatabase *database = KaZaManager::database();
+        for (quint64 handle : std::as_const(m_dbCredits)) {
+            database->release(handle);
+        }
+        m_dbCredits.clear();
+    }
+}
+
+void KaZaConnection::startStream(KaZaFileStream *stream)
+{
+    m_stream.reset(stream);
+    pumpStream();
+}
+
+void KaZaConnection::pumpStream()
+{
+    // Keep about two chunks queued: enough to fill the link, while object
+    // updates only ever wait behind a couple of chunks
+    while (m_stream && !m_congested && outboundBytes() < 2 * KaZaFileStream::ChunkSize) {
+        m_protocol.sendCommand(m_stream->nextFrame());
+        if (m_stream->atEnd()) {
+            m_stream.reset();
+        }
     }
 }
 
+qint32 KaZaConnection::clientIndex(quint16 objectId) const
+{
+    return KaZaManager::dispatcher()->clientIndex(objectId, this);
+}
+
+KaZaSession KaZaConnection::saveSession() const
+{
+    KaZaSession session;
+    session.user = m_user;
+    session.dmzEnabled = m_dmzEnabled;
+    session.dmzInterval = m_dmzInterval;
+    session.objectIdIndexes = m_objectIdIndexes;
+    session.dmzNextIndex = m_dmzNextIndex;
+    session.sharedFrames = m_sharedFrames;
+    session.batchWindow = m_batchWindow;
+    session.alarmsSubscribed = m_alarmsSubscribed;
+    session.alarmsVersion = KaZaManager::alarmsVersion();
+    for (const PatternSubscription &subscription : m_patterns) {
+        session.patterns.append(qMakePair(subscription.pattern.pattern(), subscription.interval));
+    }
+    const QList<QPair<quint16, quint16>> subscriptions = KaZaManager::dispatcher()->subscriptions(this);
+    for (const QPair<quint16, quint16> &subscription : subscriptions) {
+        const Throttle throttle = m_throttles.value(subscription.second, Throttle{0});
+        session.subscriptions.append(KaZaSession::Subscription{subscription.first, subscription.second, throttle.interval});
+    }
+    return session;
+}
+
+void KaZaConnection::resumeSession(const QString &token, quint64 since)
+{
+    KaZaSession session;
+    if (!KaZaManager::takeSession(token, m_user, session)) {
+        qInfo().noquote().nospace() << idlog() << ": Session can't be resumed";
+        m_protocol.sendCommand("RESUME:FAIL");
+        return;
+    }
+
+    // Keep the token, the client still knows it
+    m_sessionToken = token;
+    m_sharedFrames = session.sharedFrames;
+    m_batchWindow = session.batchWindow;
+    m_dmzEnabled = session.dmzEnabled;
+    m_dmzInterval = session.dmzInterval;
+    m_objectIdIndexes = session.objectIdIndexes;
+    m_dmzNextIndex = session.dmzNextIndex;
+
+    // Subscriptions are restored silently. Values still queued or held back
+    // when the link dropped may never have reached the client: only a
+    // generation the client applied (OBJLIST/OBJDELTA) limits the resent
+    // values to the ones changed since, otherwise every value is sent again.
+    const bool known = since > 0 && KaZaManager::isCurrentGeneration(since);
+    qsizetype changed = 0;
+    qsizetype skipped = 0;
+    for (const KaZaSession::Subscription &subscription : std::as_const(session.subscriptions)) {
+        KaZaObject *obj = KaZaManager::getObject(subscription.objectId);
+        if (!obj) continue;
+        if (m_inbound.value(subscription.index) || clientIndex(subscription.objectId) >= 0) {
+            // Index or object already taken by a subscription made on this connection
+            skipped++;
+            continue;
+        }
+        subscribeToObject(obj, subscription.index, false, subscription.interval);
+        if ((!known || KaZaManager::objectGeneration(subscription.objectId) > since) && obj->value().isValid()) {
+            sendObjectValue(subscription.index, KaZaEncodedValue(obj->value()));
+            changed++;
+        }
+    }
+    if (skipped > 0) {
+        qInfo().noquote().nospace() << idlog() << ": " << skipped << " restored subscriptions conflict with current ones";
+    }
+
+    // Objects registered meanwhile are announced like new objects
+    for (const QPair<QString, int> &pattern : std::as_const(session.patterns)) {
+        KaZaNamePattern compiled(pattern.first);
+        m_patterns.append(PatternSubscription{compiled, pattern.second});
+        for (KaZaObject *obj : KaZaManager::matchObjects(compiled)) {
+            subscribeToMatch(obj, KaZaManager::objectId(obj), pattern.second);
+        }
+    }
+    if (m_dmzEnabled) {
+        const QList<KaZaObject*> &objects = KaZaManager::objects();
+        for (qsizetype objectId = 0; objectId < objects.size(); ++objectId) {
+            if (objects[objectId] && clientIndex(objectId) < 0) {
+                subscribeDmz(objects[objectId], objectId, true);
+            }
+        }
+    }
+
+    // Alarm push: the whole set again only if it changed meanwhile
+    m_alarmsSubscribed = session.alarmsSubscribed;
+    if (m_alarmsSubscribed && KaZaManager::alarmsVersion() != session.alarmsVersion) {
+        m_protocol.sendCommand("ALARMSET:" + QString::number(KaZaManager::alarmsVersion()) + ":" + KaZaManager::alarmSetBlob());
+    }
+
+    qInfo().noquote().nospace() << idlog() << ": Session resumed, " << m_subscriptions << " subscriptions, " << changed << " changed values";
+    m_protocol.sendCommand("RESUME:OK:" + QString::number(m_subscriptions) + ":" + QString::number(changed));
+}
 
 void KaZaConnection::_processVersionNegotiated(QString &username, QString &devicename, int channel)
 {
     m_channel = channel;
     m_devicename = devicename;
-    m_user = username;
+    setUser(username);
     QString channelName;
     switch(m_channel) {
     case 0:
@@ -139,12 +635,31 @@ void KaZaConnection::_processVersionNegotiated(QString &username, QString &devic
     qInfo().noquote().nospace() << idlog() << ": " << "connected";
     m_valid = true;
 
-    m_protocol.sendCommand("APP:" + KaZaManager::appChecksum());
+    // Token to get the subscriptions back after a reconnection (RESUME:<token>)
+    quint32 token[4];
+    QRandomGenerator::system()->fillRange(token);
+    m_sessionToken = QString::fromLatin1(QByteArray(reinterpret_cast<const char*>(token), sizeof(token)).toHex());
+    m_protocol.sendCommand("SESSION:" + m_sessionToken);
+
+    sendAppChecksum(KaZaManager::appChecksum());
+
+    // Notifications sent while this device was away
+    const QList<KaZaNotificationQueue::Notification> notifications = KaZaManager::pendingNotifications(recipient());
+    if(!notifications.isEmpty())
+    {
+        qInfo().noquote().nospace() << idlog() << ": Delivering " << notifications.size() << " queued notifications";
+        sendNotifyBatch(notifications);
+    }
 
     // Send all registered objects to client
-    for(const QString &name : m_obj.keys())
+    const QList<QPair<quint16, quint16>> subscriptions = KaZaManager::dispatcher()->subscriptions(this);
+    for(const QPair<quint16, quint16> &subscription : subscriptions)
     {
-        m_protocol.sendObject(m_ids[name], m_obj[name]->value(), false);
+        KaZaObject *obj = KaZaManager::getObject(subscription.first);
+        if(obj)
+        {
+            sendObjectValue(subscription.second, KaZaEncodedValue(obj->value()));
+        }
     }
 }
 
@@ -164,6 +679,13 @@ void KaZaConnection::_processFrameSystem(const QString &command) {
         return;
     }
 
+    // Replies (OBJLIST, APP, LISTOBJECTS...) count in the send budget too
+    processCommand(command);
+    checkSendBudget();
+}
+
+void KaZaConnection::processCommand(const QString &command)
+{
     QStringList c = command.split(':');
     if(c[0] == "APP?")
     {
@@ -171,7 +693,68 @@ void KaZaConnection::_processFrameSystem(const QString &command) {
 #ifdef DEBUG_CONNECTION
         qDebug().noquote().nospace() << idlog() << ": System Asking application";
 #endif
-        m_protocol.sendFile("APP", KaZaManager::appFilename());
+        // The archived release matches the advertised checksum, the
+        // application file may be rewritten meanwhile
+        KaZaAppStore *store = KaZaManager::appStore();
+        const QString release = store ? store->versionPath(KaZaManager::appChecksum()) : QString();
+        m_protocol.sendFile("APP", release.isEmpty() ? KaZaManager::appFilename() : release);
+        return;
+    }
+
+    if(c[0] == "APPSTREAM?")
+    {
+        // Chunked application download, resumed from an offset if given:
+        // APPSTREAM:<size>:<checksum> then APPDATA:<offset>:<data>... and APPDONE:<size>
+        const qint64 offset = c.size() > 1 ? c[1].toLongLong() : 0;
+        // The archived release matches the advertised checksum, the
+        // application file may be rewritten meanwhile
+        const QString checksum = KaZaManager::appChecksum();
+        KaZaAppStore *store = KaZaManager::appStore();
+        const QString release = store ? store->versionPath(checksum) : QString();
+        QFile *file = new QFile(release.isEmpty() ? KaZaManager::appFilename() : release);
+        if(!file->open(QFile::ReadOnly) || offset < 0 || offset > file->size())
+        {
+            qWarning().noquote().nospace() << idlog() << ": Can't stream application from offset " << offset;
+            delete file;
+            m_protocol.sendCommand("APPSTREAM:ERROR");
+            return;
+        }
+#ifdef DEBUG_CONNECTION
+        qDebug().noquote().nospace() << idlog() << ": Streaming application from offset " << offset;
+#endif
+        m_protocol.sendCommand("APPSTREAM:" + QString::number(file->size()) + ":" + checksum);
+        startStream(new KaZaFileStream("APP", file, offset));
+        return;
+    }
+
+    if(c[0] == "APPDELTA?" && c.size() > 1)
+    {
+        // Binary delta from the application release the client has:
+        // APPDELTA:<size>:<from>:<to> then APPDELTADATA:<offset>:<data>... and APPDELTADONE:<size>,
+        // APPDELTA:FULL when there is no delta (the client then uses APPSTREAM?)
+        const QString from = c[1];
+        const qint64 offset = c.size() > 2 ? c[2].toLongLong() : 0;
+        const QString to = KaZaManager::appChecksum();
+        KaZaAppStore *store = KaZaManager::appStore();
+        if(!store || from == to)
+        {
+            m_protocol.sendCommand("APPDELTA:FULL");
+            return;
+        }
+        store->delta(from, to, this, [this, from, to, offset](const QString &path) {
+            QFile *file = new QFile(path);
+            if(path.isEmpty() || !file->open(QFile::ReadOnly) || offset < 0 || offset > file->size())
+            {
+                delete file;
+                m_protocol.sendCommand("APPDELTA:FULL");
+                return;
+            }
+#ifdef DEBUG_CONNECTION
+            qDebug().noquote().nospace() << idlog() << ": Streaming application delta from " << from;
+#endif
+            m_protocol.sendCommand("APPDELTA:" + QString::number(file->size()) + ":" + from + ":" + to);
+            startStream(new KaZaFileStream("APPDELTA", file, offset));
+        });
         return;
     }
 
@@ -181,6 +764,22 @@ void KaZaConnection::_processFrameSystem(const QString &command) {
 #ifdef DEBUG_CONNECTION
         qDebug().noquote().nospace() << idlog() << ": Client requesting objects list";
 #endif
+        if(c.size() > 1)
+        {
+            // OBJLIST?:<generation>: only objects changed since that generation,
+            // OBJDELTA:<generation>:<blob>, or the full OBJLIST:<generation>:<blob>
+            quint64 generation = KaZaManager::generation();
+            QString blob;
+            if(KaZaManager::objectsListDelta(c[1].toULongLong(), blob))
+            {
+                m_protocol.sendCommand("OBJDELTA:" + QString::number(generation) + ":" + blob);
+            }
+            else
+            {
+                m_protocol.sendCommand("OBJLIST:" + QString::number(generation) + ":" + KaZaManager::objectsListBlob());
+            }
+            return;
+        }
         sendObjectsList();
         return;
     }
@@ -188,59 +787,170 @@ void KaZaConnection::_processFrameSystem(const QString &command) {
     if(c[0] == "DMZ")
     {
         // Enable DMZ mode - subscribe to all objects
-        enableDMZ();
+        // DMZ:<ms> sets a minimum interval between two values of an object
+        enableDMZ((c.size() > 1) ? c[1].toInt() : 0);
         m_protocol.sendCommand("DMZ:OK");
         return;
     }
 
+    if(c[0] == "RESUME")
+    {
+        // RESUME:<token>[:<generation>], the generation being the last
+        // OBJLIST/OBJDELTA one the client applied
+        if(c.size() < 2)
+        {
+            qWarning().noquote().nospace() << idlog() << ": Invalid RESUME command " << command;
+            return;
+        }
+        resumeSession(c[1], (c.size() > 2) ? c[2].toULongLong() : 0);
+        return;
+    }
+
+    if(c[0] == "SHARED")
+    {
+        // Receive the objects list as one compressed blob built once for all
+        // clients (OBJLIST:<generation>:<blob>). Object values keep the
+        // binary object frame.
+        m_sharedFrames = true;
+        m_protocol.sendCommand("SHARED:OK");
+        return;
+    }
+
+    if(c[0] == "BATCH")
+    {
+        // Gather object changes during a window (0: one event loop iteration)
+        // and send them as UPD:<index>:<value>:<index>:<value>...
+        int window = (c.size() > 1) ? c[1].toInt() : 0;
+        int maxWindow = KaZaManager::setting("protocol/maxbatchwindow").toInt();
+        if (maxWindow <= 0) {
+            maxWindow = 1000;
+        }
+        m_batchWindow = qBound(0, window, maxWindow);
+        m_protocol.sendCommand("BATCH:OK:" + QString::number(m_batchWindow));
+        return;
+    }
+
+    if(c[0] == "DBSTREAM")
+    {
+        // Stream DB results by chunks of <rows> rows (0 to disable):
+        // one query result frame per chunk, then DBEND:<query id>:<row count>
+        const int rows = (c.size() > 1) ? c[1].toInt() : 1000;
+        m_dbStreamRows = qBound(0, rows, 100000);
+        m_protocol.sendCommand("DBSTREAM:OK:" + QString::number(m_dbStreamRows));
+        return;
+    }
+
+    if(c[0] == "NOTIFYACK" && c.size() > 1)
+    {
+        // Queued notifications up to this seq reached the client
+        KaZaManager::acknowledgeNotifications(recipient(), c[1].toULongLong());
+        return;
+    }
+
+    if(c[0] == "DBCOLUMNAR")
+    {
+        // Send DB results (whole or chunks) as DBCOL:<query id>:<base64 KaZaColumnar block>
+        m_dbColumnar = (c.size() < 2) || c[1] != "0";
+        m_protocol.sendCommand(QString("DBCOLUMNAR:OK:") + (m_dbColumnar ? "1" : "0"));
+        return;
+    }
+
+    if(c[0] == "DBSTOP" && c.size() > 1)
+    {
+        // Client doesn't want the rest of a streamed result
+        const uint32_t queryId = c[1].toUInt();
+        auto it = m_dbStreams.find(queryId);
+        if(it != m_dbStreams.end())
+        {
+            KaZaDatabase *database = KaZaManager::database();
+            if(database) database->cancelQuery(it.value());
+            m_dbCredits.removeAll(it.value());
+            m_dbStreams.erase(it);
+        }
+        m_protocol.sendCommand("DBSTOP:OK:" + QString::number(queryId));
+        return;
+    }
+
+    if(c[0] == "SUB")
+    {
+        // Subscribe to every object matching a dotted wildcard pattern,
+        // including objects registered or renamed into it later:
+        // SUB:knx.lights.*[:<ms>], each object announced by OBJSUB with its
+        // index: the object id, or a free one if the client uses it already.
+        // "*" matches within one segment (not across "." nor "/"), "**" any
+        // number of segments (see KaZaNamePattern).
+        // An object renamed out of the pattern stays subscribed.
+        if(c.size() < 2 || c[1].isEmpty())
+        {
+            qWarning().noquote().nospace() << idlog() << ": Invalid SUB command " << command;
+            return;
+        }
+        subscribeToPattern(c[1], (c.size() > 2) ? c[2].toInt() : 0);
+        return;
+    }
+
     if(c[0] == "OBJ")
     {
-        // Register object for connection
+        // Register object for connection: OBJ:<name>:<index>[:<ms>]
+        // with an optional minimum interval between two values, answered by
+        // OBJ:ERROR:<name>:<index> if the index already holds another object
         QString &name = c[1];
         quint16 index = c[2].toInt();
+        int interval = (c.size() > 3) ? c[3].toInt() : 0;
 #ifdef DEBUG_CONNECTION
         qDebug().noquote().nospace() << idlog() << ": System Register object " << c[1];
 #endif
-        if(!m_obj.contains(c[1]))
+        KaZaObject *obj = KaZaManager::getObject(name);
+        if(!obj)
         {
-            KaZaObject *obj = KaZaManager::getObject(name);
-            if(obj)
-            {
-                m_obj[name] = obj;
-                m_ids[name] = index;
-                QObject::connect(m_obj[name], &KaZaObject::valueChanged, this, &KaZaConnection::_objectChanged);
-            }
-            else
+            qWarning() << "Can't find OBJECT " << name;
+            return;
+        }
+        qint32 objectId = KaZaManager::objectId(obj);
+        if(clientIndex(objectId) < 0)
+        {
+            if(!subscribeToObject(obj, index, false, interval))
             {
-                qWarning() << "Can't find OBJECT " << name;
+                // Index already given to another object (OBJSUB, DMZ)
+                m_protocol.sendCommand("OBJ:ERROR:" + name + ":" + QString::number(index));
                 return;
             }
         }
-        m_protocol.sendCommand("OBJDESC:" + name + ":" + m_obj[name]->unit());
-        if(m_obj[name]->value().isValid())
+        else
         {
-            m_protocol.sendObject(m_ids[name], m_obj[name]->value(), false);
+            index = clientIndex(objectId);
+            setThrottle(index, interval);
+        }
+        m_protocol.sendCommand("OBJDESC:" + name + ":" + obj->unit());
+        if(obj->value().isValid())
+        {
+            sendObjectValue(index, KaZaEncodedValue(obj->value()));
         }
         return;
     }
 
     if(c[0] == "ALARMS")
     {
-        m_user = c[1];
-        QString result;
-        for(const KzAlarm *alarm: KaZaManager::alarms())
-        {
-            if(!alarm->enable())
-                continue;
-            result.append(alarm->title());
-            result.append("\n");
-            result.append(alarm->message());
-            result.append("\n\n");
-        }
-        QByteArray inputData = result.toUtf8();
-        QByteArray compressedData = qCompress(inputData);
-        QByteArray base64Data = compressedData.toBase64();
-        m_protocol.sendCommand("ALARM:" + QString::fromUtf8(base64Data));
+        setUser(c[1]);
+        m_protocol.sendCommand("ALARM:" + KaZaManager::alarmsBlob());
+        return;
+    }
+
+    if(c[0] == "ALARMSUB")
+    {
+        // Alarm push: ALARMSET:<version>:<set> now, then ALARMADD/ALARMDEL on changes
+        if(c.size() > 1) setUser(c[1]);
+        m_alarmsSubscribed = true;
+        m_protocol.sendCommand("ALARMSET:" + QString::number(KaZaManager::alarmsVersion()) + ":" + KaZaManager::alarmSetBlob());
+        return;
+    }
+
+    if(c[0] == "OBJIDS?")
+    {
+        // Server object ids, stable across restarts (index used by SUB, and
+        // by DMZ for clients asking them before enabling it)
+        if(!m_dmzEnabled) m_objectIdIndexes = true;
+        m_protocol.sendCommand("OBJIDS:" + KaZaManager::objectIds());
         return;
     }
 
@@ -291,14 +1001,6 @@ void KaZaConnection::_processFrameSystem(const QString &command) {
     qWarning().noquote().nospace() << idlog() << ": Unknown System Command " << command;
 }
 
-void KaZaConnection::_objectChanged() {
-    KaZaObject *obj = qobject_cast<KaZaObject*>(QObject::sender());
-#ifdef DEBUG_CONNECTION
-    qDebug() << "_objectChanged " << obj->name() << obj->value();
-#endif
-    m_protocol.sendObject(m_ids[obj->name()], obj->value(), false);
-}
-
 void KaZaConnection::_disconnectFromHost()
 {
     qInfo().noquote().nospace() << idlog() << ": Disconnected";
@@ -318,7 +1020,7 @@ void KaZaConnection::_processFrameObject(quint16 objectId, QVariant value, bool
         return;
     }
 
-    KaZaObject *obj = m_obj.value(m_ids.key(objectId), nullptr);
+    KaZaObject *obj = m_inbound.value(objectId, nullptr);
     if(obj == nullptr)
     {
         qWarning() << idlog() << ": Can't find object with id" << objectId;
@@ -336,35 +1038,77 @@ void KaZaConnection::_processFrameDbQuery(uint32_t queryId, QString query) {
         return;
     }
 
-    QSqlQuery q;
-    if(q.exec(query))
+    KaZaDatabase *database = KaZaManager::database();
+    if(!database || !database->isReady())
     {
-        QList<QList<QVariant>> result;
-        bool first = true;
-        QStringList columns;
-        while(q.next())
+        qWarning().noquote().nospace() << idlog() << ": No database for query " << queryId;
+        return;
+    }
+
+    if(m_dbStreamRows > 0)
+    {
+        streamDbQuery(queryId, query);
+        return;
+    }
+
+    // Run on a database worker, the result comes back on the event loop
+    database->exec(query, this, [this, queryId, query](const KaZaDatabase::Result &result) {
+        if(result.ok)
         {
-            QList<QVariant> data;
-            for(int i = 0; i < q.record().count(); i++)
-            {
-                if(first)
-                {
-                    columns.append(q.record().fieldName(i));
-                }
-                data.append(q.value(i));
+            sendDbResult(queryId, result);
+        }
+        else
+        {
+            qWarning().noquote() << "QUERY FAIL " + query + ": " + result.error;
+        }
+    });
+}
+
+void KaZaConnection::streamDbQuery(uint32_t queryId, const QString &query)
+{
+    if (m_dbStreams.contains(queryId)) {
+        // The chunks of both streams could not be told apart
+        qWarning().noquote().nospace() << idlog() << ": Query id " << queryId << " already streaming";
+        m_protocol.sendCommand("DBERROR:" + QString::number(queryId));
+        return;
+    }
+
+    KaZaDatabase *database = KaZaManager::database();
+    const quint64 handle = database->execStream(query, this, m_dbStreamRows,
+        [this, queryId](const KaZaDatabase::Result &chunk) {
+            const quint64 handle = m_dbStreams.value(queryId);
+            sendDbResult(queryId, chunk);
+            // Let the worker read the next chunk once this one is mostly sent
+            if (outboundBytes() <= m_highWatermark / 2) {
+                KaZaManager::database()->release(handle);
+            } else {
+                m_dbCredits.append(handle);
             }
-            if(first)
-            {
-                first = false;
+        },
+        [this, queryId, query](const KaZaDatabase::Result &result) {
+            m_dbStreams.remove(queryId);
+            if (result.ok) {
+                m_protocol.sendCommand("DBEND:" + QString::number(queryId) + ":" + QString::number(result.rowCount));
+            } else {
+                qWarning().noquote() << "QUERY FAIL " + query + ": " + result.error;
+                m_protocol.sendCommand("DBERROR:" + QString::number(queryId));
             }
-            result.append(data);
-        }
-        m_protocol.sendDbQueryResult(queryId, columns, result);
+        });
+    m_dbStreams.insert(queryId, handle);
+}
+
+void KaZaConnection::sendDbResult(uint32_t queryId, const KaZaDatabase::Result &result)
+{
+    if(m_dbColumnar)
+    {
+        const QByteArray block = KaZaColumnar::encode(result.columns, result.types, result.rows);
+        m_protocol.sendCommand("DBCOL:" + QString::number(queryId) + ":" + QString::fromLatin1(block.toBase64()));
     }
     else
     {
-        qWarning() << "QUERY FAIL " + query;
+        m_protocol.sendDbQueryResult(queryId, result.columns, result.rows);
     }
+    checkSendBudget();
 }
 
 void KaZaConnection::_processFrameSocketConnect(uint16_t socketId, const QString hostname, uint16_t port)
@@ -375,6 +1119,8 @@ void KaZaConnection::_processFrameSocketConnect(uint16_t socketId, const QString
         return;
     }
     m_sockets[socketId] = new QTcpSocket();
+    // Bounded, so a paused socket pushes back on its peer instead of buffering
+    m_sockets[socketId]->setReadBufferSize(64 * 1024);
     QObject::connect(m_sockets[socketId], &QTcpSocket::readyRead, this, &KaZaConnection::_sockReadyRead);
     QObject::connect(m_sockets[socketId], &QTcpSocket::stateChanged, this, &KaZaConnection::_sockStateChange);
 
@@ -398,9 +1144,9 @@ void KaZaConnection::_sockReadyRead()
     QTcpSocket *sock = qobject_cast<QTcpSocket *>(QObject::sender());
     if(sock)
     {
-        uint16_t id = m_sockets.key(sock);
-        QByteArray data = sock->readAll();
-        m_protocol.sendSocketData(id, data);
+        // Left in the socket while the client is slow, read when it drains
+        if(isCongested()) return;
+        forwardSocketData(sock);
     }
     else
     {
@@ -408,6 +1154,14 @@ void KaZaConnection::_sockReadyRead()
     }
 }
 
+void KaZaConnection::forwardSocketData(QTcpSocket *sock)
+{
+    uint16_t id = m_sockets.key(sock);
+    QByteArray data = sock->readAll();
+    m_protocol.sendSocketData(id, data);
+    checkSendBudget();
+}
+
 void KaZaConnection::_sockStateChange(QAbstractSocket::SocketState state)
 {
     QTcpSocket *sock = qobject_cast<QTcpSocket *>(QObject::sender());
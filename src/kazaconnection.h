@@ -6,25 +6,92 @@
 #include <QVariant>
 #include <QAbstractSocket>
 #include <QGeoCoordinate>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <kazaprotocol.h>
+#include "kazanametrie.h"
+#include "kazadispatcher.h"
+#include "kazafilestream.h"
+#include "kazanotificationqueue.h"
+#include "kazadatabase.h"
 
 
 class QTcpSocket;
 class KaZaObject;
 
+/**
+ * @brief Subscription state of a lost connection, kept for session resumption
+ */
+struct KaZaSession
+{
+    struct Subscription {
+        quint16 objectId;
+        quint16 index;
+        int interval;
+    };
+
+    QString user;
+    QList<Subscription> subscriptions;
+    QList<QPair<QString, int>> patterns;    // pattern, interval
+    bool dmzEnabled {false};
+    int dmzInterval {0};
+    bool objectIdIndexes {false};
+    quint32 dmzNextIndex {0};
+    bool sharedFrames {false};
+    int batchWindow {-1};
+    bool alarmsSubscribed {false};
+    quint64 alarmsVersion {0};              // last alarm set version the client got
+    qint64 expiry {0};                      // ms since epoch
+};
+
 class KaZaConnection : public QObject
 {
     Q_OBJECT
     KaZaProtocol m_protocol;
+    QTcpSocket *m_socket;
     QString m_user;
     QString m_devicename;
-    int m_channel;
+    int m_channel {-1};
     QString m_idlog;
-    QMap<QString, KaZaObject*>  m_obj;
-    QMap<QString, quint16>      m_ids;
+    QList<KaZaObject*>          m_inbound;      // client index -> object
+    qsizetype                   m_subscriptions {0};
     QMap<uint16_t, QTcpSocket*> m_sockets;
+    struct PatternSubscription {
+        KaZaNamePattern pattern;
+        int interval;
+    };
+    struct Throttle {
+        int interval;                                   // ms between two values sent to the client
+        qint64 lastSent {-1};
+        bool pending {false};
+        KaZaEncodedValue value;                         // latest held back value
+    };
+    QList<PatternSubscription> m_patterns;
     bool m_dmzEnabled {false};
+    int m_dmzInterval {0};
+    bool m_objectIdIndexes {false};                 // DMZ indexes are server object ids (client asked OBJIDS?)
+    quint32 m_dmzNextIndex {0};                     // legacy DMZ: next LISTOBJECTS position
+    QHash<quint16, Throttle>    m_throttles;        // client index -> throttle, only for throttled subscriptions
+    QElapsedTimer m_clock;
+    QTimer m_throttleTimer;
+    bool m_sharedFrames {false};                    // OBJLIST sent as the blob shared by all clients
+    int m_batchWindow {-1};                         // ms, -1 when batching is disabled
+    QTimer m_batchTimer;
+    QHash<quint16, KaZaEncodedValue> m_pendingValues;   // client index -> latest value not sent yet
+    QList<quint16>              m_pendingOrder;
+    qint64 m_highWatermark;
+    qint64 m_sendBudget;
+    bool m_congested {false};
+    bool m_overBudget {false};
+    quint64 m_collapsedUpdates {0};
     bool m_valid {false};
+    QString m_sessionToken;
+    bool m_alarmsSubscribed {false};
+    int m_dbStreamRows {0};                         // rows per DB result chunk, 0: whole results
+    bool m_dbColumnar {false};                      // DB results as DBCOL column encoded frames
+    QHash<uint32_t, quint64> m_dbStreams;           // client query id -> streamed query
+    QList<quint64> m_dbCredits;                     // chunk credits held until the socket drains
+    QScopedPointer<KaZaFileStream> m_stream;        // chunked download in progress
     QGeoCoordinate m_gpsPosition;
     QString m_gpsProvider;
 
@@ -32,15 +99,40 @@ public:
     explicit KaZaConnection(QTcpSocket *socket, QObject *parent = nullptr);
     quint16 id();
     void sendNotify(QString text);
+    void sendNotifyBatch(const QList<KaZaNotificationQueue::Notification> &notifications);
+    void sendAppChecksum(const QString &checksum);
+    void sendAlarmFrame(const QString &frame);
     void askPosition();
     void sendObjectsList();
-    void enableDMZ();
-    void subscribeToObject(KaZaObject *obj, quint16 index, bool sendDesc = true);
+    void enableDMZ(int interval = 0);
+    /**
+     * @brief Subscribe to an object under a client index
+     * @return false if the object is unknown or already subscribed, or the index holds another object
+     */
+    bool subscribeToObject(KaZaObject *obj, quint16 index, bool sendDesc = true, int interval = 0);
+    void unsubscribeFromObject(KaZaObject *obj, quint16 objectId);
+    void sendObjectValue(quint16 index, const KaZaEncodedValue &value);
+    void subscribeToPattern(const QString &pattern, int interval = 0);
+    void objectRegistered(KaZaObject *obj, quint16 index);
     bool isDmzEnabled() const { return m_dmzEnabled; }
     QGeoCoordinate gpsPosition() const { return m_gpsPosition; }
     QString gpsProvider() const { return m_gpsProvider; }
 
     QString user() const;
+    void setUser(const QString &user);
+
+    /**
+     * @brief Notification recipient of this connection: "<user>/<device>/<channel>"
+     */
+    QString recipient() const;
+    QString idlog() const;
+    QString sessionToken() const { return m_sessionToken; }
+    KaZaSession saveSession() const;
+
+    qint64 outboundBytes() const;
+    qsizetype pendingUpdates() const { return m_pendingValues.size(); }
+    quint64 collapsedUpdates() const { return m_collapsedUpdates; }
+    qsizetype subscriptionCount() const { return m_subscriptions; }
 
 signals:
     void disconnectFromHost();
@@ -59,11 +151,29 @@ private slots:
     void _sockReadyRead();
     void _sockStateChange(QAbstractSocket::SocketState state);
 
-    void _objectChanged();
     void _disconnectFromHost();
+    void _flushPendingValues();
+    void _flushThrottledValues();
+    void _socketBytesWritten();
 
 private:
-    QString idlog() const;
+    void subscribeToMatch(KaZaObject *obj, quint16 objectId, int interval);
+    void subscribeDmz(KaZaObject *obj, quint16 objectId, bool sendDesc);
+    qint32 freeIndex(quint16 preferred) const;
+    void setThrottle(quint16 index, int interval);
+    void writeObjectValue(quint16 index, const KaZaEncodedValue &value);
+    void sendValueFrame(quint16 index, const KaZaEncodedValue &value);
+    bool isCongested();
+    bool checkSendBudget();
+    void processCommand(const QString &command);
+    void forwardSocketData(QTcpSocket *sock);
+    void resumeSession(const QString &token, quint64 since);
+    quint16 dmzIndex(quint16 objectId);
+    qint32 clientIndex(quint16 objectId) const;
+    void startStream(KaZaFileStream *stream);
+    void streamDbQuery(uint32_t queryId, const QString &query);
+    void sendDbResult(uint32_t queryId, const KaZaDatabase::Result &result);
+    void pumpStream();
 };
 
 #endif // KAZACONNECTION_H
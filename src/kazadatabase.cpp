@@ -0,0 +1,493 @@
+#include "kazadatabase.h"
+#include <QCache>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlField>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QThread>
+
+/**
+ * @brief Database connection living in one worker thread
+ */
+class KaZaDatabase::Worker : public QObject
+{
+public:
+    explicit Worker(const QString &connectionName)
+        : m_connectionName(connectionName)
+    {
+    }
+
+    // Worker thread
+    bool open(const KaZaDatabase::Settings &settings)
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(settings.driver, m_connectionName);
+        database.setDatabaseName(settings.databaseName);
+        database.setHostName(settings.hostName);
+        database.setPort(settings.port);
+        if(!database.open(settings.userName, settings.password))
+        {
+            qWarning() << "Database worker" << m_connectionName << "open error:" << database.lastError();
+            return false;
+        }
+        m_streamTimeout = settings.streamTimeout;
+        m_statements.setMaxCost(qMax(1, settings.statementCache));
+        if(settings.statementTimeout > 0 && settings.driver == "QPSQL")
+        {
+            QSqlQuery timeout(database);
+            if(!timeout.exec("SET statement_timeout = " + QString::number(settings.statementTimeout)))
+            {
+                qWarning() << "Database worker" << m_connectionName << "can't set statement_timeout:" << timeout.lastError();
+            }
+            else
+            {
+                m_statementTimeout = true;
+            }
+        }
+        return true;
+    }
+
+    // Worker thread
+    void close()
+    {
+        m_statements.clear();
+        {
+            QSqlDatabase database = QSqlDatabase::database(m_connectionName, false);
+            database.close();
+        }
+        QSqlDatabase::removeDatabase(m_connectionName);
+    }
+
+    // Worker thread
+    KaZaDatabase::Result run(const QString &query, const QVariant &values, const std::atomic<bool> &canceled,
+                             int chunkRows, QSemaphore *credits,
+                             const std::function<void(const KaZaDatabase::Result &)> &emitChunk)
+    {
+        if(chunkRows <= 0 || !m_statementTimeout)
+        {
+            return execute(query, values, canceled, chunkRows, credits, emitChunk);
+        }
+
+        // A stream is paced by its consumer and may legitimately last longer
+        // than the statement timeout: lift it for this transaction only
+        QSqlDatabase database = QSqlDatabase::database(m_connectionName, false);
+        if(!database.transaction())
+        {
+            qWarning() << "Database worker" << m_connectionName << "can't start a transaction:" << database.lastError();
+            return execute(query, values, canceled, chunkRows, credits, emitChunk);
+        }
+        QSqlQuery timeout(database);
+        if(!timeout.exec("SET LOCAL statement_timeout = 0"))
+        {
+            qWarning() << "Database worker" << m_connectionName << "can't lift statement_timeout:" << timeout.lastError();
+        }
+        const KaZaDatabase::Result result = execute(query, values, canceled, chunkRows, credits, emitChunk);
+        if(result.ok)
+        {
+            database.commit();
+        }
+        else
+        {
+            database.rollback();
+        }
+        return result;
+    }
+
+private:
+    KaZaDatabase::Result execute(const QString &query, const QVariant &values, const std::atomic<bool> &canceled,
+                                 int chunkRows, QSemaphore *credits,
+                                 const std::function<void(const KaZaDatabase::Result &)> &emitChunk)
+    {
+        KaZaDatabase::Result result;
+        QSqlQuery adhoc(QSqlDatabase::database(m_connectionName, false));
+        QSqlQuery *q = &adhoc;
+        if(values.isValid())
+        {
+            // Bound values: prepared once per worker, cached by statement text
+            KaZaDatabase::Statement *statement = m_statements.object(query);
+            if(!statement)
+            {
+                statement = new KaZaDatabase::Statement{QSqlQuery(QSqlDatabase::database(m_connectionName, false)),
+                                                        KaZaDatabase::placeholderNames(query)};
+                statement->query.setForwardOnly(true);
+                if(!statement->query.prepare(query))
+                {
+                    result.error = statement->query.lastError().text();
+                    delete statement;
+                    return result;
+                }
+                m_statements.insert(query, statement);
+            }
+            q = &statement->query;
+            KaZaDatabase::bindValues(*statement, values);
+            if(!q->exec())
+            {
+                result.error = q->lastError().text();
+                m_statements.remove(query);
+                return result;
+            }
+        }
+        else
+        {
+            adhoc.setForwardOnly(true);
+            if(!adhoc.exec(query))
+            {
+                result.error = adhoc.lastError().text();
+                return result;
+            }
+        }
+
+        const QSqlRecord record = q->record();
+        for(int i = 0; i < record.count(); i++)
+        {
+            result.columns.append(record.fieldName(i));
+            result.types.append(record.field(i).metaType());
+        }
+
+        // A streamed chunk waits for a credit, so the worker never reads far
+        // ahead of a slow client. A client that stops reading would hold the
+        // worker forever: the stream is dropped when no credit comes in time
+        auto sendChunk = [&]() {
+            QElapsedTimer waiting;
+            waiting.start();
+            while(!credits->tryAcquire(1, 100))
+            {
+                if(canceled)
+                {
+                    result.error = "canceled";
+                    return false;
+                }
+                if(m_streamTimeout > 0 && waiting.hasExpired(m_streamTimeout))
+                {
+                    result.error = "stalled, consumer not reading";
+                    return false;
+                }
+            }
+            emitChunk(result);
+            result.rows.clear();
+            return true;
+        };
+
+        while(q->next())
+        {
+            if(canceled)
+            {
+                q->finish();
+                result.error = "canceled";
+                result.rows.clear();
+                return result;
+            }
+            QList<QVariant> row;
+            row.reserve(result.columns.size());
+            for(int i = 0; i < result.columns.size(); i++)
+            {
+                row.append(q->value(i));
+            }
+            result.rows.append(row);
+            result.rowCount++;
+
+            if(chunkRows > 0 && result.rows.size() >= chunkRows && !sendChunk())
+            {
+                q->finish();
+                result.rows.clear();
+                return result;
+            }
+        }
+        // Last (or only, for an empty result) chunk
+        if(chunkRows > 0 && (!result.rows.isEmpty() || result.rowCount == 0) && !sendChunk())
+        {
+            q->finish();
+            result.rows.clear();
+            return result;
+        }
+        q->finish();
+        result.ok = true;
+        return result;
+    }
+
+    QString m_connectionName;
+    bool m_statementTimeout {false};
+    int m_streamTimeout {0};
+    QCache<QString, KaZaDatabase::Statement> m_statements {64};
+};
+
+KaZaDatabase::KaZaDatabase(QObject *parent)
+    : QObject{parent}
+{
+}
+
+KaZaDatabase::~KaZaDatabase()
+{
+    m_queue.clear();
+    for(const Job &job: std::as_const(m_running))
+    {
+        *job.canceled = true;
+    }
+    for(qsizetype i = 0; i < m_workers.size(); ++i)
+    {
+        Worker *worker = m_workers[i];
+        QMetaObject::invokeMethod(worker, [worker]() { worker->close(); }, Qt::BlockingQueuedConnection);
+        m_threads[i]->quit();
+        m_threads[i]->wait();
+        delete worker;
+        delete m_threads[i];
+    }
+}
+
+bool KaZaDatabase::open(const Settings &settings)
+{
+    m_settings = settings;
+    m_settings.streamWorkers = qMax(1, settings.streamWorkers);
+    const int workers = qMax(1, settings.workers) + m_settings.streamWorkers;
+    for(int i = 0; i < workers; ++i)
+    {
+        QThread *thread = new QThread();
+        thread->setObjectName("kazad-db-" + QString::number(i));
+        Worker *worker = new Worker("kazad-db-" + QString::number(i));
+        worker->moveToThread(thread);
+        thread->start();
+
+        bool opened = false;
+        QMetaObject::invokeMethod(worker, [worker, settings, &opened]() {
+            opened = worker->open(settings);
+        }, Qt::BlockingQueuedConnection);
+        if(!opened)
+        {
+            QMetaObject::invokeMethod(worker, [worker]() { worker->close(); }, Qt::BlockingQueuedConnection);
+            thread->quit();
+            thread->wait();
+            delete worker;
+            delete thread;
+            break;
+        }
+        m_workers.append(worker);
+        m_idle.append(worker);
+        m_threads.append(thread);
+    }
+
+    if(m_workers.isEmpty())
+    {
+        return false;
+    }
+    // Keep a worker for plain queries whatever the number of connections opened,
+    // streams are refused when there is none left for them
+    m_settings.streamWorkers = qMin(m_settings.streamWorkers, int(m_workers.size()) - 1);
+    if(m_settings.streamWorkers == 0)
+    {
+        qWarning() << "Database pool has a single worker, streamed queries are disabled";
+    }
+    qInfo() << "Database pool ready with" << m_workers.size() << "workers," << m_settings.streamWorkers << "for streams";
+    return true;
+}
+
+quint64 KaZaDatabase::exec(const QString &query, QObject *owner, Callback callback)
+{
+    Job job{m_nextId++, query, owner, owner, callback, QSharedPointer<std::atomic<bool>>::create(false)};
+    return enqueue(job);
+}
+
+quint64 KaZaDatabase::exec(const QString &statement, const QVariant &values, QObject *owner, Callback callback)
+{
+    Job job{m_nextId++, statement, owner, owner, callback, QSharedPointer<std::atomic<bool>>::create(false)};
+    job.values = values.isValid() ? values : QVariant(QVariantList());
+    return enqueue(job);
+}
+
+QStringList KaZaDatabase::placeholderNames(const QString &statement)
+{
+    QStringList names;
+    QChar quote;
+    for(qsizetype i = 0; i < statement.size(); ++i)
+    {
+        const QChar c = statement[i];
+        if(!quote.isNull())
+        {
+            if(c == quote) quote = QChar();
+            continue;
+        }
+        if(c == '\'' || c == '"')
+        {
+            quote = c;
+        }
+        else if(c == '-' && statement.mid(i, 2) == "--")
+        {
+            i = statement.indexOf('\n', i);
+            if(i < 0) break;
+        }
+        else if(c == ':' && i + 1 < statement.size())
+        {
+            if(statement[i + 1] == ':')
+            {
+                i++; // "::" cast
+                continue;
+            }
+            qsizetype end = i + 1;
+            while(end < statement.size() && (statement[end].isLetterOrNumber() || statement[end] == '_'))
+            {
+                end++;
+            }
+            if(end > i + 1)
+            {
+                const QString name = statement.mid(i, end - i);
+                if(!names.contains(name)) names.append(name);
+                i = end - 1;
+            }
+        }
+    }
+    return names;
+}
+
+void KaZaDatabase::bindValues(Statement &statement, const QVariant &values)
+{
+    // A cached statement keeps the values of its previous run: every
+    // placeholder is bound again, NULL when no value is given for it
+    QSqlQuery &query = statement.query;
+    if(values.metaType().id() == QMetaType::QVariantMap)
+    {
+        const QVariantMap map = values.toMap();
+        for(const QString &name: std::as_const(statement.placeholders))
+        {
+            query.bindValue(name, map.value(name.mid(1)));
+        }
+    }
+    else
+    {
+        const QVariantList list = values.toList();
+        const qsizetype count = qMax(list.size(), query.boundValues().size());
+        for(qsizetype i = 0; i < count; ++i)
+        {
+            query.bindValue(i, list.value(i));
+        }
+    }
+}
+
+quint64 KaZaDatabase::execStream(const QString &query, QObject *owner, int chunkRows, Callback chunk, Callback callback)
+{
+    Job job{m_nextId++, query, owner, owner, callback, QSharedPointer<std::atomic<bool>>::create(false)};
+    if(m_settings.streamWorkers <= 0)
+    {
+        QPointer<QObject> guard(owner);
+        QMetaObject::invokeMethod(this, [guard, callback]() {
+            Result result;
+            result.error = "no worker for streamed queries";
+            if(guard) callback(result);
+        }, Qt::QueuedConnection);
+        return job.id;
+    }
+    job.chunkRows = qMax(1, chunkRows);
+    job.chunk = chunk;
+    job.credits = QSharedPointer<QSemaphore>::create(StreamCredits);
+    return enqueue(job);
+}
+
+quint64 KaZaDatabase::enqueue(Job job)
+{
+    m_queue.enqueue(job);
+    dispatch();
+    return job.id;
+}
+
+void KaZaDatabase::release(quint64 id)
+{
+    auto it = m_running.constFind(id);
+    if(it != m_running.cend() && it->credits)
+    {
+        it->credits->release();
+    }
+}
+
+void KaZaDatabase::cancel(const QObject *owner)
+{
+    m_queue.removeIf([owner](const Job &job) { return job.ownerKey == owner; });
+    for(const Job &job: std::as_const(m_running))
+    {
+        if(job.ownerKey == owner)
+        {
+            *job.canceled = true;
+        }
+    }
+}
+
+void KaZaDatabase::cancelQuery(quint64 id)
+{
+    m_queue.removeIf([id](const Job &job) { return job.id == id; });
+    auto it = m_running.constFind(id);
+    if(it != m_running.cend())
+    {
+        *it->canceled = true;
+    }
+}
+
+void KaZaDatabase::dispatch()
+{
+    while(!m_idle.isEmpty() && !m_queue.isEmpty())
+    {
+        // Streams past their budget wait, plain queries go past them
+        qsizetype next = 0;
+        if(m_runningStreams >= m_settings.streamWorkers)
+        {
+            while(next < m_queue.size() && m_queue[next].chunkRows > 0)
+            {
+                next++;
+            }
+            if(next == m_queue.size())
+            {
+                return;
+            }
+        }
+        Worker *worker = m_idle.takeLast();
+        const Job job = m_queue.takeAt(next);
+        m_running.insert(job.id, job);
+        if(job.chunkRows > 0)
+        {
+            m_runningStreams++;
+        }
+
+        QPointer<KaZaDatabase> self(this);
+        const quint64 id = job.id;
+        const QString query = job.query;
+        const QVariant values = job.values;
+        const int chunkRows = job.chunkRows;
+        const QSharedPointer<std::atomic<bool>> canceled = job.canceled;
+        const QSharedPointer<QSemaphore> credits = job.credits;
+        QMetaObject::invokeMethod(worker, [self, worker, id, query, values, chunkRows, canceled, credits]() {
+            auto emitChunk = [self, id](const Result &chunk) {
+                QMetaObject::invokeMethod(self, [self, id, chunk]() {
+                    if(self) self->chunkReady(id, chunk);
+                }, Qt::QueuedConnection);
+            };
+            const Result result = worker->run(query, values, *canceled, chunkRows, credits.data(), emitChunk);
+            QMetaObject::invokeMethod(self, [self, worker, id, result]() {
+                if(self) self->finished(worker, id, result);
+            }, Qt::QueuedConnection);
+        }, Qt::QueuedConnection);
+    }
+}
+
+void KaZaDatabase::chunkReady(quint64 id, const Result &chunk)
+{
+    const Job job = m_running.value(id);
+    if(*job.canceled || !job.owner)
+    {
+        return;
+    }
+    job.chunk(chunk);
+}
+
+void KaZaDatabase::finished(Worker *worker, quint64 id, const Result &result)
+{
+    const Job job = m_running.take(id);
+    m_idle.append(worker);
+    if(job.chunkRows > 0)
+    {
+        m_runningStreams--;
+    }
+    dispatch();
+
+    if(!*job.canceled && job.owner)
+    {
+        job.callback(result);
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef KAZADATABASE_H
+#define KAZADATABASE_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPointer>
+#include <QQueue>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QSqlQuery>
+#include <QStringList>
+#include <QVariant>
+#include <atomic>
+#include <functional>
+
+class QThread;
+
+/**
+ * @brief Pool of database worker threads
+ *
+ * Every worker thread owns its own QSqlDatabase connection; queries are
+ * queued and run by the first idle worker, so a slow query never blocks the
+ * event loop. Results are delivered on the thread of the pool (the main
+ * thread) through a callback, skipped if the owner of the query is destroyed
+ * meanwhile.
+ *
+ * A query can be canceled by its owner: a queued query is dropped, a running
+ * one stops at the next row. On PostgreSQL each worker connection sets a
+ * statement_timeout so a runaway query is also stopped by the server;
+ * streamed queries, paced by their consumer, are run without it.
+ *
+ * Statements with bound values are prepared once per worker connection and
+ * kept in a cache of statementCache entries keyed by statement text.
+ *
+ * Streamed queries deliver their rows in chunks as they are read from the
+ * cursor. The worker only reads ahead a bounded number of chunks: each chunk
+ * takes a credit, given back by the consumer with release() once the chunk
+ * is on its way, so memory stays bounded whatever the result size.
+ * A stream holds its worker while a slow client drains: streams get their
+ * own workers, on top of the ones for plain queries, and at most that many
+ * streams run at once so they never hold back plain queries. A stream whose
+ * consumer gives no credit back for streamTimeout fails, freeing its worker.
+ */
+class KaZaDatabase : public QObject
+{
+    Q_OBJECT
+public:
+    struct Settings {
+        QString driver;
+        QString databaseName;
+        QString hostName;
+        int port {-1};
+        QString userName;
+        QString password;
+        int statementTimeout {0};       // ms, 0 to disable
+        int workers {2};
+        int streamWorkers {1};          // concurrent streamed queries
+        int streamTimeout {30000};      // ms a stream waits for its consumer, 0 to wait forever
+        int statementCache {64};        // prepared statements kept per worker
+    };
+
+    struct Result {
+        bool ok {false};
+        QString error;
+        QStringList columns;
+        QList<QMetaType> types;         // declared column types
+        QList<QList<QVariant>> rows;
+        qint64 rowCount {0};            // total rows read
+    };
+
+    using Callback = std::function<void(const Result &result)>;
+
+    /**
+     * @brief Prepared statement kept in a statement cache
+     */
+    struct Statement {
+        QSqlQuery query;
+        QStringList placeholders;       // named placeholders (":name"), parsed once at prepare
+    };
+
+    static constexpr int StreamCredits = 2;     // chunks read ahead of the consumer
+
+    explicit KaZaDatabase(QObject *parent = nullptr);
+    ~KaZaDatabase() override;
+
+    /**
+     * @brief Start the worker threads and open their connections
+     * @return false if no worker could be started
+     */
+    bool open(const Settings &settings);
+    bool isReady() const { return !m_workers.isEmpty(); }
+
+    /**
+     * @brief Queue a query
+     *
+     * @param query SQL statement
+     * @param owner Object the result is for, used for cancellation
+     * @param callback Called on the pool thread with the result
+     * @return Query id
+     */
+    quint64 exec(const QString &query, QObject *owner, Callback callback);
+
+    /**
+     * @brief Queue a statement with bound values, prepared once per worker
+     *
+     * @param values List for positional (?) placeholders, map for named (:name) ones
+     */
+    quint64 exec(const QString &statement, const QVariant &values, QObject *owner, Callback callback);
+
+    /**
+     * @brief Named placeholders (":name") of a statement, in order of first use
+     *
+     * Quoted strings and identifiers, "--" comments and PostgreSQL "::" casts
+     * are skipped, like QSqlQuery does when it rewrites named placeholders.
+     */
+    static QStringList placeholderNames(const QString &statement);
+
+    /**
+     * @brief Bind a list (positional placeholders) or a map (named placeholders),
+     * placeholders without a value are bound to NULL
+     */
+    static void bindValues(Statement &statement, const QVariant &values);
+
+    /**
+     * @brief Queue a streamed query
+     *
+     * @param query SQL statement
+     * @param owner Object the result is for, used for cancellation
+     * @param chunkRows Rows per chunk
+     * @param chunk Called on the pool thread for each chunk (columns and rows);
+     *        release() must be called once the chunk is consumed
+     * @param callback Called after the last chunk, with the row count and the error if any
+     * @return Query id
+     */
+    quint64 execStream(const QString &query, QObject *owner, int chunkRows, Callback chunk, Callback callback);
+
+    /**
+     * @brief Give back a chunk credit of a streamed query
+     */
+    void release(quint64 id);
+
+    /**
+     * @brief Cancel every queued and running query of an owner
+     */
+    void cancel(const QObject *owner);
+
+    /**
+     * @brief Cancel one query
+     */
+    void cancelQuery(quint64 id);
+
+    qsizetype queuedQueries() const { return m_queue.size(); }
+    qsizetype runningQueries() const { return m_running.size(); }
+
+private:
+    class Worker;
+
+    struct Job {
+        quint64 id;
+        QString query;
+        const QObject *ownerKey;
+        QPointer<QObject> owner;
+        Callback callback;
+        QSharedPointer<std::atomic<bool>> canceled;
+        int chunkRows {0};                          // 0: the whole result at once
+        Callback chunk;
+        QSharedPointer<QSemaphore> credits;
+        QVariant values {};                         // invalid: plain query, else bound values
+    };
+
+    quint64 enqueue(Job job);
+    void dispatch();
+    void chunkReady(quint64 id, const Result &chunk);
+    void finished(Worker *worker, quint64 id, const Result &result);
+
+    Settings m_settings;
+    QList<Worker*> m_workers;
+    QList<Worker*> m_idle;
+    QList<QThread*> m_threads;
+    QQueue<Job> m_queue;
+    QHash<quint64, Job> m_running;
+    int m_runningStreams {0};
+    quint64 m_nextId {1};
+};
+
+#endif // KAZADATABASE_H
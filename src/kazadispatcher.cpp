@@ -0,0 +1,124 @@
+#include "kazadispatcher.h"
+#include "kazaconnection.h"
+#include <QDataStream>
+
+const QString &KaZaEncodedValue::encoded() const
+{
+    if(!m_isEncoded)
+    {
+        m_encoded = encode(m_value);
+        m_isEncoded = true;
+    }
+    return m_encoded;
+}
+
+QString KaZaEncodedValue::encode(const QVariant &value)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << value;
+    return QString::fromLatin1(data.toBase64());
+}
+
+bool KaZaDispatcher::subscribe(quint16 objectId, KaZaConnection *conn, quint16 index)
+{
+    QList<qint32> &positions = m_positions[conn];
+    if(objectId >= positions.size())
+    {
+        positions.resize(objectId + 1, -1);
+    }
+    if(positions[objectId] >= 0)
+    {
+        return false;
+    }
+    if(objectId >= m_subscribers.size())
+    {
+        m_subscribers.resize(objectId + 1);
+    }
+
+    QList<Subscriber> &subscribers = m_subscribers[objectId];
+    positions[objectId] = subscribers.size();
+    subscribers.append(Subscriber{conn, index});
+    return true;
+}
+
+bool KaZaDispatcher::unsubscribe(quint16 objectId, KaZaConnection *conn)
+{
+    auto it = m_positions.find(conn);
+    if(it == m_positions.end() || objectId >= it->size() || it->at(objectId) < 0)
+    {
+        return false;
+    }
+
+    QList<Subscriber> &subscribers = m_subscribers[objectId];
+    const qint32 position = it->at(objectId);
+    (*it)[objectId] = -1;
+
+    // Swap with the last subscriber to keep the removal O(1)
+    const qsizetype last = subscribers.size() - 1;
+    if(position != last)
+    {
+        subscribers[position] = subscribers[last];
+        m_positions[subscribers[position].connection][objectId] = position;
+    }
+    subscribers.removeLast();
+    return true;
+}
+
+void KaZaDispatcher::unsubscribeAll(KaZaConnection *conn)
+{
+    const QList<qint32> positions = m_positions.value(conn);
+    for(qsizetype objectId = 0; objectId < positions.size(); ++objectId)
+    {
+        if(positions[objectId] >= 0)
+        {
+            unsubscribe(objectId, conn);
+        }
+    }
+    m_positions.remove(conn);
+}
+
+void KaZaDispatcher::objectRenamed(quint16 previousId, quint16 objectId)
+{
+    const QList<Subscriber> subscribers = m_subscribers.value(previousId);
+    for(const Subscriber &subscriber: subscribers)
+    {
+        unsubscribe(previousId, subscriber.connection);
+        subscribe(objectId, subscriber.connection, subscriber.index);
+    }
+}
+
+qint32 KaZaDispatcher::clientIndex(quint16 objectId, const KaZaConnection *conn) const
+{
+    auto it = m_positions.constFind(conn);
+    if(it == m_positions.cend()) return -1;
+
+    const qint32 position = it->value(objectId, -1);
+    if(position < 0) return -1;
+    return m_subscribers[objectId][position].index;
+}
+
+QList<QPair<quint16, quint16>> KaZaDispatcher::subscriptions(const KaZaConnection *conn) const
+{
+    QList<QPair<quint16, quint16>> result;
+    const QList<qint32> positions = m_positions.value(conn);
+    for(qsizetype objectId = 0; objectId < positions.size(); ++objectId)
+    {
+        if(positions[objectId] >= 0)
+        {
+            result.append(qMakePair(quint16(objectId), m_subscribers[objectId][positions[objectId]].index));
+        }
+    }
+    return result;
+}
+
+void KaZaDispatcher::dispatch(quint16 objectId, const KaZaEncodedValue &value) const
+{
+    // Iterate on a shallow copy: a subscriber may unsubscribe while sending
+    const QList<Subscriber> subscribers = m_subscribers.value(objectId);
+    for(const Subscriber &subscriber: subscribers)
+    {
+        subscriber.connection->sendObjectValue(subscriber.index, value);
+    }
+}
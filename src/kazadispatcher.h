@@ -0,0 +1,84 @@
+#ifndef KAZADISPATCHER_H
+#define KAZADISPATCHER_H
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QVariant>
+
+class KaZaConnection;
+
+/**
+ * @brief Object value as dispatched to the subscribers of one change
+ *
+ * The text encoding used by batched updates (base64 of the QDataStream
+ * serialized QVariant) is built by the first subscriber asking for it, then
+ * shared (implicitly, reference counted) by every other subscriber of the
+ * same change. Binary object frames are still encoded per connection.
+ */
+class KaZaEncodedValue
+{
+public:
+    KaZaEncodedValue() = default;
+    explicit KaZaEncodedValue(const QVariant &value) : m_value(value) {}
+
+    const QVariant &value() const { return m_value; }
+    const QString &encoded() const;
+
+    static QString encode(const QVariant &value);
+
+private:
+    QVariant m_value;
+    mutable QString m_encoded;
+    mutable bool m_isEncoded {false};
+};
+
+/**
+ * @brief Central subscription table used to fan out object changes
+ *
+ * The manager connects each object once; on change the value is read once
+ * and pushed to every subscriber of the object with the index chosen for
+ * that connection. Each object id owns a compact (connection, index) list;
+ * each connection owns a flat object id -> list position table, so
+ * subscribe and unsubscribe are O(1) (swap with the last subscriber).
+ */
+class KaZaDispatcher
+{
+public:
+    struct Subscriber {
+        KaZaConnection *connection;
+        quint16 index;
+    };
+
+    /**
+     * @return false if the connection is already subscribed to this object
+     */
+    bool subscribe(quint16 objectId, KaZaConnection *conn, quint16 index);
+    bool unsubscribe(quint16 objectId, KaZaConnection *conn);
+    void unsubscribeAll(KaZaConnection *conn);
+
+    /**
+     * @brief Move every subscription of an object to its new id
+     */
+    void objectRenamed(quint16 previousId, quint16 objectId);
+
+    /**
+     * @brief Index used by a connection for an object, -1 if not subscribed
+     */
+    qint32 clientIndex(quint16 objectId, const KaZaConnection *conn) const;
+
+    /**
+     * @brief (object id, client index) of every subscription of a connection
+     */
+    QList<QPair<quint16, quint16>> subscriptions(const KaZaConnection *conn) const;
+
+    qsizetype subscriberCount(quint16 objectId) const { return m_subscribers.value(objectId).size(); }
+
+    void dispatch(quint16 objectId, const KaZaEncodedValue &value) const;
+
+private:
+    QList<QList<Subscriber>> m_subscribers;
+    QHash<const KaZaConnection*, QList<qint32>> m_positions;
+};
+
+#endif // KAZADISPATCHER_H
@@ -0,0 +1,43 @@
+#include "kazafilestream.h"
+#include <QDebug>
+
+KaZaFileStream::KaZaFileStream(const QString &prefix, QIODevice *source, qint64 offset)
+    : m_prefix(prefix)
+    , m_source(source)
+    , m_position(qBound(qint64(0), offset, source->size()))
+{
+}
+
+KaZaFileStream::~KaZaFileStream()
+{
+    delete m_source;
+}
+
+QString KaZaFileStream::nextFrame()
+{
+    if(m_finished)
+    {
+        return QString();
+    }
+    if(m_position >= m_source->size())
+    {
+        m_finished = true;
+        return m_prefix + "DONE:" + QString::number(m_position);
+    }
+
+    QByteArray chunk;
+    if(m_source->seek(m_position))
+    {
+        chunk = m_source->read(qMin(ChunkSize, m_source->size() - m_position));
+    }
+    if(chunk.isEmpty())
+    {
+        qWarning() << "Can't read stream source at" << m_position << ":" << m_source->errorString();
+        m_finished = true;
+        return m_prefix + "ERROR:" + QString::number(m_position);
+    }
+
+    const QString frame = m_prefix + "DATA:" + QString::number(m_position) + ":" + QString::fromLatin1(chunk.toBase64());
+    m_position += chunk.size();
+    return frame;
+}
@@ -0,0 +1,49 @@
+#ifndef KAZAFILESTREAM_H
+#define KAZAFILESTREAM_H
+
+#include <QIODevice>
+#include <QString>
+
+/**
+ * @brief Chunked transfer of a file over the command channel
+ *
+ * The source is read one chunk at a time with positioned reads, so a transfer
+ * only holds one chunk in memory whatever the file size, and the connection
+ * can send other frames between two chunks. A transfer can start at any
+ * offset to resume an interrupted download.
+ *
+ * Frames: "<prefix>DATA:<offset>:<base64 chunk>" for each chunk, then
+ * "<prefix>DONE:<size>" (or "<prefix>ERROR:<offset>" if the source can't be read).
+ */
+class KaZaFileStream
+{
+public:
+    static constexpr qint64 ChunkSize = 32 * 1024;
+
+    /**
+     * @param prefix Frame name prefix (e.g., "APP")
+     * @param source Open, seekable device; the stream takes ownership
+     * @param offset Position to start from
+     */
+    KaZaFileStream(const QString &prefix, QIODevice *source, qint64 offset = 0);
+    ~KaZaFileStream();
+    KaZaFileStream(const KaZaFileStream &) = delete;
+    KaZaFileStream &operator=(const KaZaFileStream &) = delete;
+
+    qint64 size() const { return m_source->size(); }
+    qint64 position() const { return m_position; }
+    bool atEnd() const { return m_finished; }
+
+    /**
+     * @brief Next frame to send, the last one is the DONE (or ERROR) frame
+     */
+    QString nextFrame();
+
+private:
+    QString m_prefix;
+    QIODevice *m_source;
+    qint64 m_position;
+    bool m_finished {false};
+};
+
+#endif // KAZAFILESTREAM_H
@@ -8,15 +8,20 @@
 #include "kzalarm.h"
 #include "internalobject.h"
 #include "kazacertificategenerator.h"
+#include "kazatlstickets.h"
 
 #include <QUrl>
 #include <QQmlContext>
 #include <QFile>
 #include <QDir>
+#include <QFileInfo>
 #include <QSslKey>
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QDataStream>
+#include <QDateTime>
+#include <QElapsedTimer>
 
 KaZaManager *KaZaManager::m_instance = {nullptr};
 
@@ -58,7 +63,14 @@ bool KaZaManager::ensureCertificatesExist()
         return false;
     }
 
-    return KaZaCertificateGenerator::generateCertificates(hostname, keyPassword, "/var/lib/kazad");
+    bool ok;
+    const QString algorithmName = m_settings.value("ssl/keyalgorithm", "rsa").toString();
+    KaZaCertificateGenerator::KeyAlgorithm algorithm = KaZaCertificateGenerator::keyAlgorithm(algorithmName, &ok);
+    if (!ok) {
+        qWarning() << "Unknown ssl/keyalgorithm" << algorithmName << ", using RSA";
+    }
+
+    return KaZaCertificateGenerator::generateCertificates(hostname, keyPassword, "/var/lib/kazad", algorithm);
 }
 
 KaZaManager::KaZaManager(QObject *parent)
@@ -67,12 +79,37 @@ KaZaManager::KaZaManager(QObject *parent)
 {
     m_instance = this;
 
+    // Generations start from the boot time, so a generation seen by a client
+    // before a restart is always older than the first one of this run (up to
+    // 2^20 changes per second of uptime). Seconds << 20 stays below 2^53, so
+    // JavaScript clients parse it as a Number without losing precision.
+    m_firstGeneration = quint64(QDateTime::currentSecsSinceEpoch()) << 20;
+    m_generation = m_firstGeneration;
+    m_removalGeneration = m_firstGeneration;
+
     // Ensure SSL certificates exist, generate if needed
     if (!ensureCertificatesExist()) {
         qCritical() << "Failed to ensure SSL certificates exist - server cannot start";
         return;
     }
 
+    // Object ids must be known before the QML configuration registers objects
+    m_objects.load("/var/lib/kazad/objects.ids", m_settings.value("objects/keepstarts", 10).toInt());
+
+    // Notifications for devices not connected, delivered at their next connection
+    m_queueNotifications = m_settings.value("notifications/queue", true).toBool();
+    if(m_queueNotifications)
+    {
+        m_notifications.load("/var/lib/kazad/notifications.queue",
+                             m_settings.value("notifications/maxsize", 1024 * 1024).toLongLong(),
+                             m_settings.value("notifications/ttl", 86400).toLongLong() * 1000,
+                             m_settings.value("notifications/maxperuser", 100).toInt());
+    }
+
+    m_alarmTimer.setSingleShot(true);
+    m_alarmTimer.setInterval(0);
+    QObject::connect(&m_alarmTimer, &QTimer::timeout, this, &KaZaManager::_flushAlarmChanges);
+
     QString qmlconf = m_settings.value("qml/server").toString();
 
     qmlRegisterType<KaZaObject>("org.kazoe.kaza", 1, 0, "KaZaObject");
@@ -109,14 +146,24 @@ KaZaManager::KaZaManager(QObject *parent)
     }
     configuration.setLocalCertificate(certfilelist.first());
 
-    QFile key(keyfile);
-    if(!key.open(QFile::ReadOnly)) {
-        qWarning() << "Couldn't open private key:" << key.errorString();
+    // The key algorithm is the one the certificates were generated with (RSA, ECDSA or Ed25519)
+    QSslKey sslkey = KaZaCertificateGenerator::loadPrivateKey(keyfile, m_settings.value("ssl/keypassword").toByteArray());
+    if(sslkey.isNull()) {
+        qWarning() << "Failed to load server private key from:" << keyfile;
         return;
     }
-    QSslKey sslkey(&key, QSsl::Rsa, QSsl::Pem, QSsl::PrivateKey, m_settings.value("ssl/keypassword").toByteArray());
     configuration.setPrivateKey(sslkey);
+
+    // Session tickets shared by every connection, so a client reconnecting
+    // gets an abbreviated handshake
+    const int ticketLifetime = m_settings.value("ssl/ticketlifetime", 43200).toInt();
+    if(ticketLifetime > 0 && KaZaTlsTickets::install(ticketLifetime))
+    {
+        QObject::connect(&m_ticketTimer, &QTimer::timeout, this, []() { KaZaTlsTickets::rotate(); });
+        m_ticketTimer.start(qMax(60, ticketLifetime) * 1000);
+    }
     m_server.setSslConfiguration(configuration);
+    trackHandshakes(&m_server, &m_serverHandshakes);
 
     QObject::connect(&m_server, &QSslServer::pendingConnectionAvailable, this, &KaZaManager::_pendingConnectionAvailable);
     QObject::connect(&m_server, &QSslServer::errorOccurred, [this](QSslSocket *socket, QAbstractSocket::SocketError socketError){
@@ -133,12 +180,11 @@ KaZaManager::KaZaManager(QObject *parent)
     // Uses SSL but without client certificate requirement (VerifyNone)
     bool controlEnable = m_settings.value("control/enable", true).toBool();
     if (controlEnable) {
-        // Configure SSL for control port (same certs as main server)
-        QSslConfiguration controlConfig;
-        controlConfig.setLocalCertificate(configuration.localCertificate());
-        controlConfig.setPrivateKey(configuration.privateKey());
+        // Configure SSL for control port (same certs and options as main server)
+        QSslConfiguration controlConfig = configuration;
         controlConfig.setPeerVerifyMode(QSslSocket::VerifyNone);  // No client cert required
         m_remotecontrol.setSslConfiguration(controlConfig);
+        trackHandshakes(&m_remotecontrol, &m_controlHandshakes);
 
         QObject::connect(&m_remotecontrol, &QSslServer::pendingConnectionAvailable, this, &KaZaManager::_pendingRemoteConnectionAvailable);
         QObject::connect(&m_remotecontrol, &QSslServer::errorOccurred, [this](QSslSocket *socket, QAbstractSocket::SocketError socketError){
@@ -153,6 +199,19 @@ KaZaManager::KaZaManager(QObject *parent)
 
     /* Calculate current App Checksum */
     m_appFilename = m_settings.value("qml/client").toString();
+    m_appStore.setPath("/var/lib/kazad/app", m_settings.value("qml/appversions", 5).toInt());
+    updateAppChecksum();
+    if(!m_appFilename.isEmpty())
+    {
+        // The directory is watched too: an rcc replaced by rename drops the file watch
+        m_appWatcher.addPath(m_appFilename);
+        m_appWatcher.addPath(QFileInfo(m_appFilename).absolutePath());
+        m_appTimer.setSingleShot(true);
+        m_appTimer.setInterval(500);
+        QObject::connect(&m_appWatcher, &QFileSystemWatcher::fileChanged, &m_appTimer, qOverload<>(&QTimer::start));
+        QObject::connect(&m_appWatcher, &QFileSystemWatcher::directoryChanged, &m_appTimer, qOverload<>(&QTimer::start));
+        QObject::connect(&m_appTimer, &QTimer::timeout, this, &KaZaManager::_appFileChanged);
+    }
 
     QString dbdriver = m_settings.value("database/driver").toString();
     if(!dbdriver.isEmpty())
@@ -169,6 +228,25 @@ KaZaManager::KaZaManager(QObject *parent)
         {
             m_databaseReady = true;
         }
+        m_statements.setMaxCost(qMax(1, m_settings.value("database/statementcache", 64).toInt()));
+
+        // Client queries run on worker threads, each with its own connection
+        KaZaDatabase::Settings dbsettings;
+        dbsettings.driver = dbdriver;
+        dbsettings.databaseName = m_settings.value("database/dbName").toString();
+        dbsettings.hostName = m_settings.value("database/hostname").toString();
+        dbsettings.port = m_settings.value("database/port").toInt();
+        dbsettings.userName = m_settings.value("database/username").toString();
+        dbsettings.password = m_settings.value("database/password").toString();
+        dbsettings.statementTimeout = m_settings.value("database/statementtimeout", 30000).toInt();
+        dbsettings.workers = m_settings.value("database/workers", 2).toInt();
+        dbsettings.streamWorkers = m_settings.value("database/streamworkers", 1).toInt();
+        dbsettings.streamTimeout = m_settings.value("database/streamtimeout", 30000).toInt();
+        dbsettings.statementCache = m_settings.value("database/statementcache", 64).toInt();
+        if(!m_database.open(dbsettings))
+        {
+            qWarning() << "Database worker pool not available, client queries disabled";
+        }
     }
 
     // Mark initialization as successful
@@ -176,6 +254,12 @@ KaZaManager::KaZaManager(QObject *parent)
     qInfo() << "KaZa Server initialized successfully";
 }
 
+KaZaManager::~KaZaManager()
+{
+    // QML objects are destroyed with the engine, after the registry
+    m_instance = nullptr;
+}
+
 KaZaManager *KaZaManager::getInstance() {
     return m_instance;
 }
@@ -186,18 +270,92 @@ void KaZaManager::registerObject(KaZaObject* obj) {
         qWarning() << "No KaZaManager object";
         return;
     }
-    m_instance->m_objects.append(obj);
+    qint32 previousId = m_instance->m_objects.id(obj);
+    if(!m_instance->m_objects.insert(obj))
+    {
+        // Rejected duplicate or no id left: a renamed object gets back the
+        // name it is indexed under, so name() and the registry agree
+        if(previousId != KaZaObjectRegistry::InvalidId)
+        {
+            obj->setName(m_instance->m_objects.name(obj));
+        }
+        return;
+    }
+    quint16 id = m_instance->m_objects.id(obj);
+    if(previousId != KaZaObjectRegistry::InvalidId)
+    {
+        // Rename of an already registered object: its id follows the name
+        if(previousId != id)
+        {
+            m_instance->m_dispatcher.objectRenamed(previousId, id);
+            for(KaZaSession &session: m_instance->m_sessions)
+            {
+                for(KaZaSession::Subscription &subscription: session.subscriptions)
+                {
+                    if(subscription.objectId == previousId)
+                    {
+                        subscription.objectId = id;
+                    }
+                }
+            }
+            m_instance->m_removalGeneration = ++m_instance->m_generation;
+            m_instance->touchObject(id);
+        }
+        // The new name may match patterns the old one didn't
+        for (KaZaConnection* conn : std::as_const(m_instance->m_clients)) {
+            conn->objectRegistered(obj, id);
+        }
+        return;
+    }
+    m_instance->touchObject(id);
+
+    // Single connection per object, fanned out by the dispatcher
+    QObject::connect(obj, &KaZaObject::valueChanged, m_instance, [obj]() {
+        if(!m_instance) return;
+        qint32 objectId = m_instance->m_objects.id(obj);
+        if(objectId >= 0)
+        {
+            m_instance->touchObject(objectId);
+            m_instance->m_dispatcher.dispatch(objectId, KaZaEncodedValue(obj->value()));
+        }
+    });
+    QObject::connect(obj, &KaZaObject::unitChanged, m_instance, [obj]() {
+        if(!m_instance) return;
+        qint32 objectId = m_instance->m_objects.id(obj);
+        if(objectId >= 0)
+        {
+            m_instance->touchObject(objectId);
+        }
+    });
     emit m_instance->objectAdded();
 
-    // Subscribe DMZ connections to new object
-    quint16 nextIndex = m_instance->m_objects.size();
-    for (KaZaConnection* conn : m_instance->m_clients) {
-        if (conn && conn->isDmzEnabled()) {
-            conn->subscribeToObject(obj, nextIndex);
+    // Subscribe DMZ and wildcard connections to new object
+    for (KaZaConnection* conn : std::as_const(m_instance->m_clients)) {
+        if (conn) {
+            conn->objectRegistered(obj, id);
         }
     }
 }
 
+void KaZaManager::unregisterObject(KaZaObject *obj)
+{
+    if(!m_instance)
+    {
+        // Manager already destroyed (shutdown), nothing to clean
+        return;
+    }
+    qint32 id = m_instance->m_objects.id(obj);
+    if(!m_instance->m_objects.remove(obj))
+    {
+        return;
+    }
+    // A delta can't express a removal, older clients get a full list
+    m_instance->m_removalGeneration = ++m_instance->m_generation;
+    for (KaZaConnection* conn : std::as_const(m_instance->m_clients)) {
+        conn->unsubscribeFromObject(obj, id);
+    }
+}
+
 void KaZaManager::registerAlarm(KzAlarm *obj)
 {
     if(!m_instance)
@@ -206,9 +364,141 @@ void KaZaManager::registerAlarm(KzAlarm *obj)
         return;
     }
     m_instance->m_alarms.append(obj);
+    m_instance->m_alarmIds.insert(obj, m_instance->m_nextAlarmId++);
+    QObject::connect(obj, &KzAlarm::enableChanged, m_instance, &KaZaManager::_alarmChanged);
+    QObject::connect(obj, &KzAlarm::titleChanged, m_instance, &KaZaManager::_alarmChanged);
+    QObject::connect(obj, &KzAlarm::messageChanged, m_instance, &KaZaManager::_alarmChanged);
+    QObject::connect(obj, &QObject::destroyed, m_instance, &KaZaManager::_alarmDestroyed);
     emit m_instance->alarmAdded();
 }
 
+void KaZaManager::_alarmChanged()
+{
+    KzAlarm *alarm = qobject_cast<KzAlarm*>(QObject::sender());
+    if(!alarm) return;
+    m_changedAlarms.insert(alarm);
+    if(!m_alarmTimer.isActive())
+    {
+        m_alarmTimer.start();
+    }
+}
+
+void KaZaManager::_alarmDestroyed(QObject *obj)
+{
+    KzAlarm *alarm = static_cast<KzAlarm*>(obj);
+    m_alarms.removeAll(alarm);
+    m_changedAlarms.remove(alarm);
+    const quint32 id = m_alarmIds.take(alarm);
+    if(m_activeAlarms.remove(alarm))
+    {
+        m_alarmsVersion++;
+        const QString frame = QString("ALARMDEL:%1:%2").arg(m_alarmsVersion).arg(id);
+        for(KaZaConnection *conn: std::as_const(m_clients))
+        {
+            conn->sendAlarmFrame(frame);
+        }
+    }
+}
+
+void KaZaManager::_flushAlarmChanges()
+{
+    QList<QPair<KzAlarm*, bool>> changes;   // alarm, enabled
+    for(KzAlarm *alarm: std::as_const(m_changedAlarms))
+    {
+        if(alarm->enable())
+        {
+            m_activeAlarms.insert(alarm);
+            changes.append(qMakePair(alarm, true));
+        }
+        else if(m_activeAlarms.remove(alarm))
+        {
+            changes.append(qMakePair(alarm, false));
+        }
+    }
+    m_changedAlarms.clear();
+    if(changes.isEmpty()) return;
+
+    // ALARMADD:<version>:<id>:<title>:<message> (base64 UTF-8, also sent for an
+    // update of an enabled alarm), ALARMDEL:<version>:<id>
+    m_alarmsVersion++;
+    const QString version = QString::number(m_alarmsVersion);
+    for(const QPair<KzAlarm*, bool> &change: std::as_const(changes))
+    {
+        const QString id = QString::number(m_alarmIds.value(change.first));
+        const QString frame = change.second
+            ? "ALARMADD:" + version + ":" + id + ":"
+                  + QString::fromLatin1(change.first->title().toUtf8().toBase64()) + ":"
+                  + QString::fromLatin1(change.first->message().toUtf8().toBase64())
+            : "ALARMDEL:" + version + ":" + id;
+        for(KaZaConnection *conn: std::as_const(m_clients))
+        {
+            conn->sendAlarmFrame(frame);
+        }
+    }
+}
+
+quint64 KaZaManager::alarmsVersion()
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return 0;
+    }
+    return m_instance->m_alarmsVersion;
+}
+
+QString KaZaManager::alarmsBlob()
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return QString();
+    }
+    // Legacy ALARM: format, "<title>\n<message>\n\n" per enabled alarm, built once per version
+    if(m_instance->m_alarmsBlobVersion != m_instance->m_alarmsVersion)
+    {
+        QString result;
+        for(const KzAlarm *alarm: std::as_const(m_instance->m_alarms))
+        {
+            if(!m_instance->m_activeAlarms.contains(alarm))
+                continue;
+            result.append(alarm->title());
+            result.append("\n");
+            result.append(alarm->message());
+            result.append("\n\n");
+        }
+        m_instance->m_alarmsBlob = QString::fromUtf8(qCompress(result.toUtf8()).toBase64());
+        m_instance->m_alarmsBlobVersion = m_instance->m_alarmsVersion;
+    }
+    return m_instance->m_alarmsBlob;
+}
+
+QString KaZaManager::alarmSetBlob()
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return QString();
+    }
+    // Enabled alarms with their ids: quint32 count, then (quint32 id, QString title, QString message)
+    if(m_instance->m_alarmSetBlobVersion != m_instance->m_alarmsVersion)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_6_0);
+        stream << quint32(m_instance->m_activeAlarms.size());
+        for(const KzAlarm *alarm: std::as_const(m_instance->m_alarms))
+        {
+            if(!m_instance->m_activeAlarms.contains(alarm))
+                continue;
+            stream << m_instance->m_alarmIds.value(alarm) << alarm->title() << alarm->message();
+        }
+        m_instance->m_alarmSetBlob = QString::fromLatin1(qCompress(data).toBase64());
+        m_instance->m_alarmSetBlobVersion = m_instance->m_alarmsVersion;
+    }
+    return m_instance->m_alarmSetBlob;
+}
+
 const QList<KzAlarm *> &KaZaManager::alarms()
 {
     static QList<KzAlarm *> emptyList;
@@ -226,29 +516,94 @@ KaZaObject* KaZaManager::getObject(const QString &name) {
         qWarning() << "No KaZaManager object";
         return nullptr;
     }
-    for(KaZaObject* obj: std::as_const(m_instance->m_objects))
+    return m_instance->m_objects.object(name);
+}
+
+QStringList KaZaManager::getObjectKeys()
+{
+    if(!m_instance)
     {
-        if(obj->name() == name)
-        {
-            return obj;
-        }
+        qWarning() << "No KaZaManager object";
+        return QStringList();
     }
-    return nullptr;
+    return m_instance->m_objects.keys();
 }
 
-QStringList KaZaManager::getObjectKeys()
+const QList<KaZaObject *> &KaZaManager::objects()
 {
-    QStringList res;
+    static QList<KaZaObject *> emptyList;
     if(!m_instance)
     {
         qWarning() << "No KaZaManager object";
-        return res;
+        return emptyList;
     }
-    for(KaZaObject* obj: std::as_const(m_instance->m_objects))
+    return m_instance->m_objects.table();
+}
+
+KaZaObject *KaZaManager::getObject(quint16 id)
+{
+    if(!m_instance)
     {
-        res.append(obj->name());
+        qWarning() << "No KaZaManager object";
+        return nullptr;
     }
-    return res;
+    return m_instance->m_objects.object(id);
+}
+
+qint32 KaZaManager::objectId(const KaZaObject *obj)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return KaZaObjectRegistry::InvalidId;
+    }
+    return m_instance->m_objects.id(obj);
+}
+
+QString KaZaManager::objectIds()
+{
+    // One "<id>\t<name>" line per registered object, compressed like ALARM
+    QByteArray result;
+    const QList<KaZaObject*> &objects = KaZaManager::objects();
+    for(qsizetype id = 0; id < objects.size(); ++id)
+    {
+        if(!objects[id]) continue;
+        result.append(QByteArray::number(id));
+        result.append('\t');
+        result.append(objects[id]->name().toUtf8());
+        result.append('\n');
+    }
+    return QString::fromLatin1(qCompress(result).toBase64());
+}
+
+QList<KaZaObject *> KaZaManager::matchObjects(const KaZaNamePattern &pattern)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return QList<KaZaObject *>();
+    }
+    return m_instance->m_objects.match(pattern);
+}
+
+KaZaDispatcher *KaZaManager::dispatcher()
+{
+    if(!m_instance)
+    {
+        return nullptr;
+    }
+    return &m_instance->m_dispatcher;
+}
+
+const QList<KaZaConnection *> &KaZaManager::connections()
+{
+    static QList<KaZaConnection *> emptyList;
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return emptyList;
+    }
+    return m_instance->m_clients;
 }
 
 QVariant KaZaManager::setting(QString id) {
@@ -261,20 +616,84 @@ QVariant KaZaManager::setting(QString id) {
 }
 
 QString KaZaManager::appChecksum() {
-    QString appChecksum;
     if(!m_instance)
     {
         qWarning() << "No KaZaManager object";
         return QString();
     }
-    QFile f(m_instance->m_appFilename);
-    if (f.open(QFile::ReadOnly)) {
-        QCryptographicHash hash(QCryptographicHash::Algorithm::Md5);
-        if (hash.addData(&f)) {
-            appChecksum = hash.result().toBase64();
+    // Only updated once a change settled (_appFileChanged), so every client
+    // is told about a new release and a file being written is never hashed
+    return m_instance->m_appChecksum;
+}
+
+bool KaZaManager::updateAppChecksum()
+{
+    // Only hash the file again when its size or modification time changed
+    QFileInfo info(m_appFilename);
+    const qint64 size = info.exists() ? info.size() : -1;
+    const qint64 modified = info.exists() ? info.lastModified().toMSecsSinceEpoch() : -1;
+    if(size == m_appSize && modified == m_appModified)
+    {
+        return false;
+    }
+
+    // Keep the release so later ones can be sent as a delta from it,
+    // the checksum is the one of the archived copy
+    QString appChecksum = info.exists() ? m_appStore.archive(m_appFilename) : QString();
+    if(appChecksum.isEmpty())
+    {
+        QFile f(m_appFilename);
+        if (f.open(QFile::ReadOnly)) {
+            QCryptographicHash hash(QCryptographicHash::Algorithm::Md5);
+            if (hash.addData(&f)) {
+                appChecksum = hash.result().toBase64();
+            }
         }
     }
-    return appChecksum;
+    m_appSize = size;
+    m_appModified = modified;
+    if(appChecksum == m_appChecksum)
+    {
+        return false;
+    }
+    m_appChecksum = appChecksum;
+    return true;
+}
+
+void KaZaManager::_appFileChanged()
+{
+    if(!m_appWatcher.files().contains(m_appFilename) && QFile::exists(m_appFilename))
+    {
+        m_appWatcher.addPath(m_appFilename);
+    }
+    if(!updateAppChecksum() || m_appChecksum.isEmpty())
+    {
+        return;
+    }
+
+    qInfo() << "Client application changed, new checksum" << m_appChecksum;
+    for(KaZaConnection *conn: std::as_const(m_clients))
+    {
+        conn->sendAppChecksum(m_appChecksum);
+    }
+}
+
+KaZaDatabase *KaZaManager::database() {
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return nullptr;
+    }
+    return &m_instance->m_database;
+}
+
+KaZaAppStore *KaZaManager::appStore() {
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return nullptr;
+    }
+    return &m_instance->m_appStore;
 }
 
 QString KaZaManager::appFilename() {
@@ -286,6 +705,94 @@ QString KaZaManager::appFilename() {
     return m_instance->m_appFilename;
 }
 
+QSet<QString> KaZaManager::parseTargetUsers(const QString &text, QString *message)
+{
+    // "/alice /bob message": leading "/user" words select the target users
+    QSet<QString> targetUsers;
+    if(message) *message = text;
+    if (!text.startsWith("/")) return targetUsers;
+
+    qsizetype pos = 0;
+    while (pos < text.size())
+    {
+        while (pos < text.size() && text[pos] == ' ') pos++;
+        if (pos >= text.size() || text[pos] != '/')
+        {
+            // Found the start of the actual message
+            if(message) *message = text.mid(pos);
+            break;
+        }
+        qsizetype end = text.indexOf(' ', pos);
+        if (end < 0) end = text.size();
+        QString username = text.mid(pos + 1, end - pos - 1);
+        if (!username.isEmpty())
+        {
+            targetUsers.insert(username.toLower());
+        }
+        pos = end;
+    }
+    return targetUsers;
+}
+
+QList<KaZaConnection*> KaZaManager::userConnections(const QSet<QString> &users) const
+{
+    if (users.isEmpty()) return m_clients;
+
+    QList<KaZaConnection*> connections;
+    for (const QString &user: users)
+    {
+        connections.append(m_userConnections.values(user));
+    }
+    return connections;
+}
+
+void KaZaManager::connectionUserChanged(KaZaConnection *conn, const QString &previous)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return;
+    }
+    if(!m_instance->m_clients.contains(conn)) return;
+
+    m_instance->m_userConnections.remove(previous.toLower(), conn);
+    if(!conn->user().isEmpty())
+    {
+        m_instance->m_userConnections.insert(conn->user().toLower(), conn);
+        if(m_instance->m_queueNotifications)
+        {
+            m_instance->m_notifications.addRecipient(conn->recipient());
+        }
+    }
+}
+
+QList<KaZaNotificationQueue::Notification> KaZaManager::pendingNotifications(const QString &recipient)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return QList<KaZaNotificationQueue::Notification>();
+    }
+    if(!m_instance->m_queueNotifications)
+    {
+        return QList<KaZaNotificationQueue::Notification>();
+    }
+    return m_instance->m_notifications.pending(recipient);
+}
+
+void KaZaManager::acknowledgeNotifications(const QString &recipient, quint64 seq)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return;
+    }
+    if(m_instance->m_queueNotifications)
+    {
+        m_instance->m_notifications.acknowledge(recipient, seq);
+    }
+}
+
 void KaZaManager::sendNotify(QString text)
 {
     if(!m_instance)
@@ -295,99 +802,244 @@ void KaZaManager::sendNotify(QString text)
     }
     qInfo() << "NOTIFICATION: " << text;
 
-    // Check if text starts with "/" for user filtering
-    QStringList targetUsers;
-    QString message = text;
-
-    if (text.startsWith("/"))
+    // Send notification to the target users connections, or to everyone
+    QString message;
+    const QSet<QString> targetUsers = parseTargetUsers(text, &message);
+    const QList<KaZaConnection*> connections = m_instance->userConnections(targetUsers);
+    for(KaZaConnection* conn: connections)
     {
-        // Extract user names and actual message
-        QStringList parts = text.split(' ', Qt::SkipEmptyParts);
+        conn->sendNotify(message);
+    }
 
-        for (const QString& part : parts)
+    // Keep it for every known device of the target (or all, for a broadcast)
+    // users not connected: a user's live cpanel doesn't mean its phone got it
+    if(m_instance->m_queueNotifications)
+    {
+        QSet<QString> connected;
+        for(KaZaConnection *conn: std::as_const(m_instance->m_clients))
         {
-            if (part.startsWith("/"))
+            connected.insert(conn->recipient());
+        }
+        const QStringList recipients = m_instance->m_notifications.recipients();
+        for(const QString &recipient: recipients)
+        {
+            if(connected.contains(recipient))
             {
-                // Remove the leading "/" and add to target users list
-                QString username = part.mid(1); // Remove first character "/"
-                if (!username.isEmpty())
-                {
-                    targetUsers.append(username.toLower());
-                }
+                continue;
             }
-            else
+            if(targetUsers.isEmpty() || targetUsers.contains(recipient.section('/', 0, 0)))
             {
-                // Found the start of the actual message
-                // Reconstruct the message from this point
-                int messageStart = text.indexOf(part);
-                message = text.mid(messageStart);
-                break;
+                m_instance->m_notifications.enqueue(recipient, message);
             }
         }
     }
+}
 
-    // Send notification to appropriate connections
-    for(KaZaConnection* conn: m_instance->m_clients)
+void KaZaManager::askPosition(QString param)
+{
+    if(!m_instance)
     {
-        // If targetUsers is empty, send to all (no user filtering)
-        // Otherwise, only send if this connection's user is in the target list
-        if (targetUsers.isEmpty() || targetUsers.contains(conn->user().toLower()))
-        {
-            conn->sendNotify(message);
-        }
+        qWarning() << "No KaZaManager object";
+        return;
+    }
+
+    const QSet<QString> targetUsers = parseTargetUsers(param, nullptr);
+    const QList<KaZaConnection*> connections = m_instance->userConnections(targetUsers);
+    for(KaZaConnection* conn: connections)
+    {
+        conn->askPosition();
     }
 }
 
-void KaZaManager::askPosition(QString param)
+void KaZaManager::sendObjectsList()
 {
     if(!m_instance)
     {
         qWarning() << "No KaZaManager object";
         return;
     }
+    for(KaZaConnection* conn: std::as_const(m_instance->m_clients))
+    {
+        conn->sendObjectsList();
+    }
+}
 
-    // Check if text starts with "/" for user filtering
-    QStringList targetUsers;
+quint64 KaZaManager::generation()
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return 0;
+    }
+    return m_instance->m_generation;
+}
 
-    if (param.startsWith("/"))
+const QMap<QString, QPair<QVariant, QString>> &KaZaManager::objectsList()
+{
+    static QMap<QString, QPair<QVariant, QString>> emptyList;
+    if(!m_instance)
     {
-        // Extract user names and actual message
-        QStringList parts = param.split(' ', Qt::SkipEmptyParts);
+        qWarning() << "No KaZaManager object";
+        return emptyList;
+    }
 
-        for (const QString& part : parts)
+    // Rebuilt lazily, at most once per generation, whatever the number of requesters
+    if(m_instance->m_objectsListGeneration != m_instance->m_generation)
+    {
+        QMap<QString, QPair<QVariant, QString>> objects;
+        for(KaZaObject *obj: m_instance->m_objects.table())
         {
-            if (part.startsWith("/"))
+            if(obj)
             {
-                // Remove the leading "/" and add to target users list
-                QString username = part.mid(1); // Remove first character "/"
-                if (!username.isEmpty())
-                {
-                    targetUsers.append(username.toLower());
-                }
+                objects.insert(obj->name(), QPair<QVariant, QString>(obj->value(), obj->unit()));
             }
         }
+        m_instance->m_objectsList = objects;
+        m_instance->m_objectsListGeneration = m_instance->m_generation;
     }
+    return m_instance->m_objectsList;
+}
 
-    for(KaZaConnection* conn: m_instance->m_clients)
+QString KaZaManager::objectsListBlob()
+{
+    if(!m_instance)
     {
-        if (targetUsers.isEmpty() || targetUsers.contains(conn->user().toLower()))
-        {
-            conn->askPosition();
-        }
+        qWarning() << "No KaZaManager object";
+        return QString();
     }
+
+    // Serialized and compressed once per generation, shared by every requester
+    if(m_instance->m_objectsListBlobGeneration != m_instance->m_generation)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_6_0);
+        stream << objectsList();
+        m_instance->m_objectsListBlob = QString::fromLatin1(qCompress(data).toBase64());
+        m_instance->m_objectsListBlobGeneration = m_instance->m_generation;
+    }
+    return m_instance->m_objectsListBlob;
 }
 
-void KaZaManager::sendObjectsList()
+quint64 KaZaManager::objectGeneration(quint16 id)
 {
     if(!m_instance)
     {
         qWarning() << "No KaZaManager object";
-        return;
+        return 0;
     }
-    for(KaZaConnection* conn: m_instance->m_clients)
+    return m_instance->m_objectGenerations.value(id);
+}
+
+bool KaZaManager::isCurrentGeneration(quint64 generation)
+{
+    if(!m_instance)
     {
-        conn->sendObjectsList();
+        qWarning() << "No KaZaManager object";
+        return false;
+    }
+    // Generations of a previous run or not issued yet can't be trusted
+    return generation >= m_instance->m_firstGeneration && generation <= m_instance->m_generation;
+}
+
+bool KaZaManager::takeSession(const QString &token, const QString &user, KaZaSession &session)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return false;
+    }
+    auto it = m_instance->m_sessions.find(token);
+    if(it == m_instance->m_sessions.end())
+    {
+        return false;
+    }
+    // The token is single use, and only valid for the user it was issued to
+    bool valid = it->user == user && it->expiry > QDateTime::currentMSecsSinceEpoch();
+    if(valid)
+    {
+        session = it.value();
+    }
+    m_instance->m_sessions.erase(it);
+    return valid;
+}
+
+KaZaHandshakeStats KaZaManager::serverHandshakes()
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return KaZaHandshakeStats();
+    }
+    KaZaHandshakeStats stats = m_instance->m_serverHandshakes;
+    stats.resumed = KaZaTlsTickets::resumed(true);
+    return stats;
+}
+
+KaZaHandshakeStats KaZaManager::controlHandshakes()
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return KaZaHandshakeStats();
     }
+    KaZaHandshakeStats stats = m_instance->m_controlHandshakes;
+    stats.resumed = KaZaTlsTickets::resumed(false);
+    return stats;
+}
+
+void KaZaManager::trackHandshakes(QSslServer *server, KaZaHandshakeStats *stats)
+{
+    QObject::connect(server, &QSslServer::startedEncryptionHandshake, this, [stats](QSslSocket *socket){
+        QElapsedTimer timer;
+        timer.start();
+        QObject::connect(socket, &QSslSocket::encrypted, socket, [stats, timer](){
+            const qint64 elapsed = timer.nsecsElapsed();
+            stats->completed++;
+            stats->totalNsecs += elapsed;
+            stats->maxNsecs = qMax(stats->maxNsecs, elapsed);
+        }, Qt::SingleShotConnection);
+    });
+    // QSslServer only forwards errors of sockets not yet handed out, i.e. during the handshake
+    QObject::connect(server, &QSslServer::errorOccurred, this, [stats](QSslSocket *socket, QAbstractSocket::SocketError socketError){
+        stats->failed++;
+    });
+}
+
+bool KaZaManager::objectsListDelta(quint64 since, QString &blob)
+{
+    if(!m_instance)
+    {
+        qWarning() << "No KaZaManager object";
+        return false;
+    }
+    if(since < m_instance->m_removalGeneration || since > m_instance->m_generation)
+    {
+        // Previous run, removed objects or unknown generation
+        return false;
+    }
+
+    QMap<QString, QPair<QVariant, QString>> objects;
+    const QList<KaZaObject*> &table = m_instance->m_objects.table();
+    for(qsizetype id = 0; id < table.size(); ++id)
+    {
+        if(table[id] && m_instance->m_objectGenerations.value(id) > since)
+        {
+            objects.insert(table[id]->name(), QPair<QVariant, QString>(table[id]->value(), table[id]->unit()));
+        }
+    }
+    if(objects.size() > m_instance->m_objects.size() / 2)
+    {
+        // Too many changes, the full list is cached and cheaper
+        return false;
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << objects;
+    blob = QString::fromLatin1(qCompress(data).toBase64());
+    return true;
 }
 
 bool KaZaManager::runDbQuery(const QString &query) const
@@ -402,11 +1054,118 @@ bool KaZaManager::runDbQuery(const QString &query) const
     return res;
 }
 
+bool KaZaManager::runDbStatement(const QString &statement, const QVariant &values)
+{
+    if(!m_databaseReady) return false;
+
+    KaZaDatabase::Statement *prepared = m_statements.object(statement);
+    if(!prepared)
+    {
+        prepared = new KaZaDatabase::Statement{QSqlQuery(), KaZaDatabase::placeholderNames(statement)};
+        if(!prepared->query.prepare(statement))
+        {
+            qWarning().noquote().nospace() << statement << " prepare failed: " << prepared->query.lastError().text();
+            delete prepared;
+            return false;
+        }
+        m_statements.insert(statement, prepared);
+    }
+
+    QSqlQuery *q = &prepared->query;
+    KaZaDatabase::bindValues(*prepared, values);
+
+    const bool res = q->exec();
+    if(!res)
+    {
+        qWarning().noquote().nospace() << statement << " failed: " << q->lastError().text();
+        // Prepare again next time, the connection may have been reset
+        m_statements.remove(statement);
+    }
+    else
+    {
+        q->finish();
+    }
+    return res;
+}
+
+QJSValue KaZaManager::queryAsync(const QString &statement, const QVariant &values, const QJSValue &callback)
+{
+    // Promise settled from C++: keep its resolve and reject functions
+    QJSValue deferred = engine.evaluate("(function() { var d = {}; d.promise = new Promise(function(resolve, reject) { d.resolve = resolve; d.reject = reject; }); return d; })()");
+
+    auto settle = [this, deferred, callback](const KaZaDatabase::Result &result) {
+        QJSValue error = QJSValue::NullValue;
+        QJSValue rows = engine.newArray(result.rows.size());
+        if(result.ok)
+        {
+            for(qsizetype i = 0; i < result.rows.size(); ++i)
+            {
+                QJSValue row = engine.newObject();
+                for(qsizetype c = 0; c < result.columns.size(); ++c)
+                {
+                    row.setProperty(result.columns[c], engine.toScriptValue(result.rows[i].value(c)));
+                }
+                rows.setProperty(quint32(i), row);
+            }
+        }
+        else
+        {
+            error = QJSValue(result.error);
+        }
+
+        if(callback.isCallable())
+        {
+            const QJSValue res = callback.call({error, rows});
+            if(res.isError())
+            {
+                qWarning().noquote() << "queryAsync callback:" << res.toString();
+            }
+        }
+        if(result.ok)
+        {
+            deferred.property("resolve").call({rows});
+        }
+        else
+        {
+            deferred.property("reject").call({error});
+        }
+    };
+
+    if(!m_database.isReady())
+    {
+        KaZaDatabase::Result result;
+        result.error = "database not available";
+        // Keep the callback asynchronous, as with a real query
+        QTimer::singleShot(0, this, [settle, result]() { settle(result); });
+    }
+    else
+    {
+        m_database.exec(statement, values, this, [settle, statement](const KaZaDatabase::Result &result) {
+            if(!result.ok)
+            {
+                qWarning().noquote().nospace() << statement << " failed: " << result.error;
+            }
+            settle(result);
+        });
+    }
+    return deferred.property("promise");
+}
+
 void KaZaManager::notify(QString message)
 {
     sendNotify(message);
 }
 
+void KaZaManager::touchObject(quint16 id)
+{
+    m_generation++;
+    if(id >= m_objectGenerations.size())
+    {
+        m_objectGenerations.resize(id + 1);
+    }
+    m_objectGenerations[id] = m_generation;
+}
+
 void KaZaManager::_pendingConnectionAvailable() {
     QTcpSocket *socket = m_server.nextPendingConnection();
     if(socket)
@@ -428,7 +1187,32 @@ void KaZaManager::_disconnection() {
         qWarning() << "Error on disconnect";
         return;
     }
-    m_clients.removeAll(connection);
+    if(!m_clients.removeAll(connection))
+    {
+        return; // Already handled
+    }
+    m_userConnections.remove(connection->user().toLower(), connection);
+    if(m_queueNotifications && !connection->user().isEmpty())
+    {
+        // Notifications are kept from now on: it is seen until this point
+        m_notifications.addRecipient(connection->recipient());
+    }
+
+    // Keep the subscriptions for a grace period, for session resumption
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_sessions.removeIf([now](const QHash<QString, KaZaSession>::iterator &it) {
+        return it->expiry <= now;
+    });
+    if(!connection->sessionToken().isEmpty())
+    {
+        int grace = m_settings.value("protocol/sessiongrace", 300).toInt();
+        KaZaSession session = connection->saveSession();
+        session.expiry = now + qint64(grace) * 1000;
+        m_sessions.insert(connection->sessionToken(), session);
+    }
+
+    m_dispatcher.unsubscribeAll(connection);
+    m_database.cancel(connection);
     connection->deleteLater();
 }
 
@@ -464,3 +1248,7 @@ void KaZaManager::_remoteDisconnection() {
 void kaZaRegisterObject(KaZaObject *obj) {
     KaZaManager::registerObject(obj);
 }
+
+void kaZaUnregisterObject(KaZaObject *obj) {
+    KaZaManager::unregisterObject(obj);
+}
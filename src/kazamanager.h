@@ -4,7 +4,20 @@
 #include <QObject>
 #include <QSettings>
 #include <QQmlApplicationEngine>
+#include <QJSValue>
 #include <QSslServer>
+#include <QMap>
+#include <QSet>
+#include <QFileSystemWatcher>
+#include <QTimer>
+#include <QCache>
+#include <QSqlQuery>
+#include "kazaobjectregistry.h"
+#include "kazadispatcher.h"
+#include "kazaconnection.h"
+#include "kazaappstore.h"
+#include "kazanotificationqueue.h"
+#include "kazadatabase.h"
 
 // #define DEBUG_KNX
 // #define DEBUG_CONNECTION
@@ -15,53 +28,159 @@ class KzAlarm;
 class KaZaRemoteConnection;
 class QSqlDatabase;
 
+/**
+ * @brief TLS handshake accounting of one SSL server
+ *
+ * Durations are wall clock, from the start of the handshake to the encrypted
+ * socket: they include the network round trips, not only the server work.
+ */
+struct KaZaHandshakeStats {
+    quint64 completed {0};
+    quint64 resumed {0};            // abbreviated handshakes, from a session ticket
+    quint64 failed {0};
+    qint64 totalNsecs {0};          // sum of the handshake durations
+    qint64 maxNsecs {0};
+};
 
 class KaZaManager : public QObject
 {
     Q_OBJECT
     QSettings m_settings;
     QQmlApplicationEngine engine;
-    QList<KaZaObject*> m_objects;
+    KaZaObjectRegistry m_objects;
+    KaZaDispatcher m_dispatcher;
+    quint64 m_generation;
+    quint64 m_firstGeneration;
+    quint64 m_removalGeneration;
+    QList<quint64> m_objectGenerations;         // object id -> generation of its last change
+    QHash<QString, KaZaSession> m_sessions;     // token -> state of lost connections
+    QMap<QString, QPair<QVariant, QString>> m_objectsList;
+    quint64 m_objectsListGeneration {0};
+    QString m_objectsListBlob;
+    quint64 m_objectsListBlobGeneration {0};
     QSslServer m_server;
+    KaZaHandshakeStats m_serverHandshakes;
     QList<KaZaConnection*> m_clients;
+    QMultiHash<QString, KaZaConnection*> m_userConnections;    // lowercased user -> connections
+    KaZaNotificationQueue m_notifications;      // notifications for users not connected
+    bool m_queueNotifications {true};
     QList<KzAlarm*> m_alarms;
+    QHash<const KzAlarm*, quint32> m_alarmIds;  // stable id used by alarm deltas
+    QSet<const KzAlarm*> m_activeAlarms;        // enabled alarms, as known by clients
+    QSet<KzAlarm*> m_changedAlarms;
+    QTimer m_alarmTimer;                        // groups the changes of one event loop pass
+    quint32 m_nextAlarmId {0};
+    quint64 m_alarmsVersion {1};
+    QString m_alarmsBlob;
+    QString m_alarmSetBlob;
+    quint64 m_alarmsBlobVersion {0};
+    quint64 m_alarmSetBlobVersion {0};
     QSslServer m_remotecontrol;
+    KaZaHandshakeStats m_controlHandshakes;
     QList<KaZaRemoteConnection*> m_remoteclients;
     QString m_appFilename;
+    QString m_appChecksum;
+    qint64 m_appSize {-1};
+    qint64 m_appModified {-1};
+    QFileSystemWatcher m_appWatcher;
+    KaZaAppStore m_appStore;
+    QTimer m_appTimer;                          // settles app file changes before hashing
+    QTimer m_ticketTimer;                       // rotates the TLS session ticket keys
     bool m_databaseReady {false};
+    QCache<QString, KaZaDatabase::Statement> m_statements;  // statement text -> prepared query (main connection)
+    KaZaDatabase m_database;                    // worker pool for client queries
     bool m_initialized {false};
 
     static KaZaManager *m_instance;
 
 public:
     explicit KaZaManager(QObject *parent = nullptr);
+    ~KaZaManager() override;
 
     bool isInitialized() const { return m_initialized; }
     static KaZaManager *getInstance();
     static void registerObject(KaZaObject* obj);
+    static void unregisterObject(KaZaObject* obj);
     static void registerAlarm(KzAlarm* obj);
     static const QList<KzAlarm*>& alarms();
+    static quint64 alarmsVersion();
+    static QString alarmsBlob();
+    static QString alarmSetBlob();
     static KaZaObject* getObject(const QString &name);
     static QStringList getObjectKeys();
+    static QString objectIds();
+    static const QList<KaZaObject*> &objects();
+    static KaZaObject* getObject(quint16 id);
+    static qint32 objectId(const KaZaObject *obj);
+    static QList<KaZaObject*> matchObjects(const KaZaNamePattern &pattern);
+    static KaZaDispatcher *dispatcher();
+    static const QList<KaZaConnection*> &connections();
     static QVariant setting(QString id);
     static QString appChecksum();
     static QString appFilename();
+    static KaZaAppStore *appStore();
+    static KaZaDatabase *database();
     static void sendNotify(QString text);
     static void askPosition(QString param);
+    static void connectionUserChanged(KaZaConnection *conn, const QString &previous);
+    static QList<KaZaNotificationQueue::Notification> pendingNotifications(const QString &recipient);
+    static void acknowledgeNotifications(const QString &recipient, quint64 seq);
     static void sendObjectsList();
+    static quint64 generation();
+    static const QMap<QString, QPair<QVariant, QString>> &objectsList();
+    static QString objectsListBlob();
+    static bool objectsListDelta(quint64 since, QString &blob);
+    static quint64 objectGeneration(quint16 id);
+    static bool isCurrentGeneration(quint64 generation);
+    static bool takeSession(const QString &token, const QString &user, KaZaSession &session);
+    static KaZaHandshakeStats serverHandshakes();
+    static KaZaHandshakeStats controlHandshakes();
 
 public slots:
     bool runDbQuery(const QString &query) const;
+    /**
+     * @brief Run a statement with bound values, prepared once then cached by statement text
+     *
+     * kazamanager.runDbStatement("INSERT INTO log(name, value) VALUES (?, ?)", [name, value])
+     * kazamanager.runDbStatement("DELETE FROM log WHERE name = :name", {name: name})
+     *
+     * @param values List for positional (?) placeholders, map for named (:name) ones
+     */
+    bool runDbStatement(const QString &statement, const QVariant &values = QVariant());
     void notify(QString message);
 
+    /**
+     * @brief Run a query on a database worker without blocking the automation
+     *
+     * kazamanager.queryAsync("SELECT ts, value FROM log WHERE name = ?", [name])
+     *     .then(function(rows) { ... }, function(error) { ... })
+     *
+     * Rows are objects keyed by column name. The optional callback is called
+     * as callback(error, rows), error being null on success. Both are run on
+     * the QML engine thread.
+     *
+     * @param values List for positional (?) placeholders, map for named (:name) ones
+     * @return Promise of the rows
+     */
+    QJSValue queryAsync(const QString &statement, const QVariant &values = QVariant(), const QJSValue &callback = QJSValue());
+
 private:
     bool ensureCertificatesExist();
+    void touchObject(quint16 id);
+    bool updateAppChecksum();
+    static QSet<QString> parseTargetUsers(const QString &text, QString *message);
+    QList<KaZaConnection*> userConnections(const QSet<QString> &users) const;
+    void trackHandshakes(QSslServer *server, KaZaHandshakeStats *stats);
 
 private slots:
     void _pendingConnectionAvailable();
     void _disconnection();
     void _pendingRemoteConnectionAvailable();
     void _remoteDisconnection();
+    void _appFileChanged();
+    void _alarmChanged();
+    void _alarmDestroyed(QObject *obj);
+    void _flushAlarmChanges();
 
 signals:
     void objectAdded();
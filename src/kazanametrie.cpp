@@ -0,0 +1,189 @@
+#include "kazanametrie.h"
+#include <QSet>
+
+KaZaNamePattern::KaZaNamePattern(const QString &pattern)
+    : m_pattern(pattern)
+{
+    const QStringList parts = pattern.split('.');
+    for(const QString &part: parts)
+    {
+        if(part.isEmpty())
+        {
+            // "knx..lights" or trailing dot: reject the whole pattern
+            m_segments.clear();
+            return;
+        }
+        Segment segment;
+        segment.text = part;
+        if(part == "**")
+        {
+            segment.type = AnyDepth;
+        }
+        else if(part.contains('*') || part.contains('?') || part.contains('['))
+        {
+            segment.type = Glob;
+            segment.regexp = QRegularExpression(QRegularExpression::wildcardToRegularExpression(part));
+        }
+        else
+        {
+            segment.type = Literal;
+        }
+        m_segments.append(segment);
+    }
+}
+
+bool KaZaNamePattern::Segment::matches(const QString &segment) const
+{
+    switch(type)
+    {
+    case Literal:
+        return segment == text;
+    case Glob:
+        return regexp.match(segment).hasMatch();
+    case AnyDepth:
+        return true;
+    }
+    return false;
+}
+
+bool KaZaNamePattern::matches(const QString &name) const
+{
+    if(!isValid()) return false;
+    return matchSegments(name.split('.'), 0, 0);
+}
+
+bool KaZaNamePattern::matchSegments(const QStringList &name, qsizetype segment, qsizetype pos) const
+{
+    if(segment == m_segments.size())
+    {
+        return pos == name.size();
+    }
+    const Segment &s = m_segments[segment];
+    if(s.type == AnyDepth)
+    {
+        for(qsizetype next = pos; next <= name.size(); ++next)
+        {
+            if(matchSegments(name, segment + 1, next))
+                return true;
+        }
+        return false;
+    }
+    if(pos == name.size() || !s.matches(name[pos]))
+    {
+        return false;
+    }
+    return matchSegments(name, segment + 1, pos + 1);
+}
+
+void KaZaNameTrie::insert(const QString &name, KaZaObject *obj)
+{
+    Node *node = &m_root;
+    const QStringList parts = name.split('.');
+    for(const QString &part: parts)
+    {
+        Node *&child = node->children[part];
+        if(!child)
+        {
+            child = new Node;
+        }
+        node = child;
+    }
+    node->object = obj;
+}
+
+void KaZaNameTrie::remove(const QString &name)
+{
+    remove(&m_root, name.split('.'), 0);
+}
+
+bool KaZaNameTrie::remove(Node *node, const QStringList &name, qsizetype pos)
+{
+    if(pos == name.size())
+    {
+        node->object = nullptr;
+    }
+    else
+    {
+        auto it = node->children.find(name[pos]);
+        if(it == node->children.end())
+        {
+            return false;
+        }
+        if(remove(it.value(), name, pos + 1))
+        {
+            delete it.value();
+            node->children.erase(it);
+        }
+    }
+    // Tell the parent this branch can be pruned
+    return node != &m_root && !node->object && node->children.isEmpty();
+}
+
+QList<KaZaObject*> KaZaNameTrie::match(const KaZaNamePattern &pattern) const
+{
+    QList<KaZaObject*> result;
+    if(!pattern.isValid()) return result;
+
+    collect(&m_root, pattern, 0, result);
+
+    // Several "**" segments can reach the same node by different paths
+    qsizetype anyDepth = 0;
+    for(const KaZaNamePattern::Segment &segment: pattern.m_segments)
+    {
+        if(segment.type == KaZaNamePattern::AnyDepth)
+            anyDepth++;
+    }
+    if(anyDepth > 1)
+    {
+        QSet<KaZaObject*> seen;
+        result.removeIf([&seen](KaZaObject *obj) {
+            if(seen.contains(obj)) return true;
+            seen.insert(obj);
+            return false;
+        });
+    }
+    return result;
+}
+
+void KaZaNameTrie::collect(const Node *node, const KaZaNamePattern &pattern, qsizetype segment, QList<KaZaObject*> &result) const
+{
+    if(segment == pattern.m_segments.size())
+    {
+        if(node->object)
+        {
+            result.append(node->object);
+        }
+        return;
+    }
+
+    const KaZaNamePattern::Segment &s = pattern.m_segments[segment];
+    switch(s.type)
+    {
+    case KaZaNamePattern::Literal:
+    {
+        const Node *child = node->children.value(s.text, nullptr);
+        if(child)
+        {
+            collect(child, pattern, segment + 1, result);
+        }
+        break;
+    }
+    case KaZaNamePattern::Glob:
+        for(auto it = node->children.cbegin(); it != node->children.cend(); ++it)
+        {
+            if(s.matches(it.key()))
+            {
+                collect(it.value(), pattern, segment + 1, result);
+            }
+        }
+        break;
+    case KaZaNamePattern::AnyDepth:
+        // Zero segment, then one more segment and stay on "**"
+        collect(node, pattern, segment + 1, result);
+        for(auto it = node->children.cbegin(); it != node->children.cend(); ++it)
+        {
+            collect(it.value(), pattern, segment, result);
+        }
+        break;
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef KAZANAMETRIE_H
+#define KAZANAMETRIE_H
+
+#include <QHash>
+#include <QList>
+#include <QRegularExpression>
+#include <QString>
+#include <QStringList>
+
+class KaZaObject;
+
+/**
+ * @brief Compiled object name pattern
+ *
+ * Patterns are dotted like object names. Each segment is either:
+ * - a literal segment ("knx")
+ * - a glob on one segment ("*", "temp*", "floor?", "[ab]*"): "*" matches any
+ *   characters and "?" one character, except "." (the segment separator) and
+ *   "/" (globs follow QRegularExpression::wildcardToRegularExpression path rules)
+ * - "**", matching any number (including zero) of segments
+ *
+ * Examples: "knx.lights.*", "knx.*.entrance.*", "knx.sensors.**"
+ */
+class KaZaNamePattern
+{
+public:
+    KaZaNamePattern() = default;
+    explicit KaZaNamePattern(const QString &pattern);
+
+    QString pattern() const { return m_pattern; }
+    bool isValid() const { return !m_segments.isEmpty(); }
+    bool matches(const QString &name) const;
+
+private:
+    friend class KaZaNameTrie;
+
+    enum SegmentType {
+        Literal,
+        Glob,
+        AnyDepth
+    };
+
+    struct Segment {
+        SegmentType type;
+        QString text;
+        QRegularExpression regexp;
+        bool matches(const QString &segment) const;
+    };
+
+    bool matchSegments(const QStringList &name, qsizetype segment, qsizetype pos) const;
+
+    QString m_pattern;
+    QList<Segment> m_segments;
+};
+
+/**
+ * @brief Prefix tree of object names, one node per dotted segment
+ *
+ * Literal pattern segments are resolved with a hash lookup per level, so a
+ * subtree query only visits the matching branch of the tree.
+ */
+class KaZaNameTrie
+{
+public:
+    KaZaNameTrie() = default;
+    KaZaNameTrie(const KaZaNameTrie &) = delete;
+    KaZaNameTrie &operator=(const KaZaNameTrie &) = delete;
+
+    void insert(const QString &name, KaZaObject *obj);
+    void remove(const QString &name);
+    QList<KaZaObject*> match(const KaZaNamePattern &pattern) const;
+
+private:
+    struct Node {
+        ~Node() { qDeleteAll(children); }
+        QHash<QString, Node*> children;
+        KaZaObject *object {nullptr};
+    };
+
+    void collect(const Node *node, const KaZaNamePattern &pattern, qsizetype segment, QList<KaZaObject*> &result) const;
+    bool remove(Node *node, const QStringList &name, qsizetype pos);
+
+    Node m_root;
+};
+
+#endif // KAZANAMETRIE_H
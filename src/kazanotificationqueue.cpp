@@ -0,0 +1,180 @@
+#include "kazanotificationqueue.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QSaveFile>
+
+bool KaZaNotificationQueue::load(const QString &path, qint64 maxSize, qint64 ttl, int maxPerRecipient)
+{
+    m_maxSize = maxSize;
+    m_ttl = ttl;
+    m_maxPerRecipient = qMax(1, maxPerRecipient);
+    m_store.setFileName(path);
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if(m_store.open(QFile::ReadOnly))
+    {
+        while(!m_store.atEnd())
+        {
+            const QList<QByteArray> fields = m_store.readLine().trimmed().split('\t');
+            if((fields.size() == 2 || fields.size() == 3) && fields[0] == "K")
+            {
+                // Records without time predate expiry: seen now
+                const QString recipient = QString::fromUtf8(fields[1]);
+                const qint64 seen = fields.size() == 3 ? fields[2].toLongLong() : now;
+                m_queues[recipient];
+                m_lastSeen[recipient] = qMax(m_lastSeen.value(recipient), seen);
+            }
+            else if(fields.size() == 5 && fields[0] == "Q")
+            {
+                const quint64 seq = fields[1].toULongLong();
+                Entry entry{seq, fields[2].toLongLong(), QString::fromUtf8(QByteArray::fromBase64(fields[4]))};
+                m_queues[QString::fromUtf8(fields[3])].append(entry);
+                m_nextSeq = qMax(m_nextSeq, seq + 1);
+            }
+            else if(fields.size() == 3 && fields[0] == "A")
+            {
+                const quint64 acked = fields[2].toULongLong();
+                auto it = m_queues.find(QString::fromUtf8(fields[1]));
+                if(it != m_queues.end())
+                {
+                    it->removeIf([acked](const Entry &entry) { return entry.seq <= acked; });
+                }
+            }
+        }
+        m_store.close();
+    }
+
+    expireRecipients(now);
+    if(!m_queues.isEmpty())
+    {
+        qInfo() << "Loaded" << m_queues.size() << "notification recipients from" << path;
+    }
+
+    // Start from a store holding only what is still pending
+    return compact();
+}
+
+void KaZaNotificationQueue::expire(QList<Entry> &entries, qint64 now) const
+{
+    entries.removeIf([this, now](const Entry &entry) { return entry.time + m_ttl <= now; });
+    if(entries.size() > m_maxPerRecipient)
+    {
+        entries.remove(0, entries.size() - m_maxPerRecipient);
+    }
+}
+
+void KaZaNotificationQueue::expireRecipients(qint64 now)
+{
+    for(auto it = m_queues.begin(); it != m_queues.end();)
+    {
+        expire(it.value(), now);
+        if(it->isEmpty() && m_lastSeen.value(it.key()) + m_ttl <= now)
+        {
+            m_lastSeen.remove(it.key());
+            it = m_queues.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+QStringList KaZaNotificationQueue::recipients()
+{
+    expireRecipients(QDateTime::currentMSecsSinceEpoch());
+    return m_queues.keys();
+}
+
+bool KaZaNotificationQueue::compact()
+{
+    if(m_store.isOpen())
+    {
+        m_store.close();
+    }
+
+    QSaveFile out(m_store.fileName());
+    if(out.open(QFile::WriteOnly))
+    {
+        for(auto it = m_queues.cbegin(); it != m_queues.cend(); ++it)
+        {
+            out.write("K\t" + it.key().toUtf8() + '\t' + QByteArray::number(m_lastSeen.value(it.key())) + '\n');
+            for(const Entry &entry: it.value())
+            {
+                out.write("Q\t" + QByteArray::number(entry.seq) + '\t' + QByteArray::number(entry.time) + '\t'
+                          + it.key().toUtf8() + '\t' + entry.message.toUtf8().toBase64() + '\n');
+            }
+        }
+        out.commit();
+    }
+
+    if(!m_store.open(QFile::WriteOnly | QFile::Append))
+    {
+        qWarning() << "Can't open notification store" << m_store.fileName() << ":" << m_store.errorString();
+        return false;
+    }
+    return true;
+}
+
+void KaZaNotificationQueue::append(const QByteArray &record)
+{
+    if(!m_store.isOpen()) return;
+
+    if(m_store.size() + record.size() > m_maxSize)
+    {
+        // Drop acknowledged and expired records, then make room if still needed
+        expireRecipients(QDateTime::currentMSecsSinceEpoch());
+        compact();
+        if(m_store.size() + record.size() > m_maxSize)
+        {
+            qWarning() << "Notification store full, notification only kept in memory";
+            return;
+        }
+    }
+    m_store.write(record);
+    m_store.flush();
+}
+
+void KaZaNotificationQueue::addRecipient(const QString &recipient)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_queues[recipient];
+    m_lastSeen[recipient] = now;
+    append("K\t" + recipient.toUtf8() + '\t' + QByteArray::number(now) + '\n');
+}
+
+void KaZaNotificationQueue::enqueue(const QString &recipient, const QString &message)
+{
+    QList<Entry> &entries = m_queues[recipient];
+    Entry entry{m_nextSeq++, QDateTime::currentMSecsSinceEpoch(), message};
+    entries.append(entry);
+    expire(entries, entry.time);
+
+    append("Q\t" + QByteArray::number(entry.seq) + '\t' + QByteArray::number(entry.time) + '\t'
+           + recipient.toUtf8() + '\t' + message.toUtf8().toBase64() + '\n');
+}
+
+QList<KaZaNotificationQueue::Notification> KaZaNotificationQueue::pending(const QString &recipient)
+{
+    QList<Notification> result;
+    auto it = m_queues.find(recipient);
+    if(it == m_queues.end()) return result;
+
+    expire(it.value(), QDateTime::currentMSecsSinceEpoch());
+    for(const Entry &entry: std::as_const(it.value()))
+    {
+        result.append(Notification{entry.seq, entry.time, entry.message});
+    }
+    return result;
+}
+
+void KaZaNotificationQueue::acknowledge(const QString &recipient, quint64 seq)
+{
+    auto it = m_queues.find(recipient);
+    if(it == m_queues.end()) return;
+
+    const qsizetype count = it->size();
+    it->removeIf([seq](const Entry &entry) { return entry.seq <= seq; });
+    if(it->size() == count) return;
+    append("A\t" + recipient.toUtf8() + '\t' + QByteArray::number(seq) + '\n');
+}
@@ -0,0 +1,93 @@
+#ifndef KAZANOTIFICATIONQUEUE_H
+#define KAZANOTIFICATIONQUEUE_H
+
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+/**
+ * @brief Notifications waiting for their recipient to connect again
+ *
+ * Notifications are kept per recipient (a device of a user, see
+ * KaZaConnection::recipient()), in memory and in an append-only store so they
+ * survive a restart. They stay pending until the recipient acknowledges them,
+ * recorded as an acknowledgment; the store is rewritten with the pending
+ * notifications only at load and when it grows above its size cap.
+ *
+ * A recipient not seen (connected or disconnected) for longer than the
+ * notification lifetime, with nothing pending, is forgotten: broadcasts are no
+ * longer kept for it and its record is dropped at the next rewrite.
+ *
+ * Store format, one record per line:
+ * - "K\t<recipient>\t<ms since epoch>": known recipient and when it was last seen
+ * - "Q\t<seq>\t<ms since epoch>\t<recipient>\t<base64 UTF-8 message>": queued
+ * - "A\t<recipient>\t<seq>": every notification of the recipient up to seq acknowledged
+ */
+class KaZaNotificationQueue
+{
+public:
+    struct Notification {
+        quint64 seq;
+        qint64 time;                // ms since epoch
+        QString message;
+    };
+
+    /**
+     * @brief Load the pending notifications and open the store for appends
+     *
+     * @param path Store file (e.g., /var/lib/kazad/notifications.queue)
+     * @param maxSize Size cap of the store in bytes
+     * @param ttl Lifetime of a notification in ms
+     * @param maxPerRecipient Maximum pending notifications per recipient, the oldest are dropped
+     * @return false if the store can't be opened, notifications are then only kept in memory
+     */
+    bool load(const QString &path, qint64 maxSize, qint64 ttl, int maxPerRecipient);
+
+    /**
+     * @brief Remember a recipient, or record it is seen again (connection, disconnection)
+     *
+     * Broadcast notifications are kept for every known recipient.
+     */
+    void addRecipient(const QString &recipient);
+
+    void enqueue(const QString &recipient, const QString &message);
+
+    /**
+     * @brief Pending notifications of a recipient, oldest first
+     */
+    QList<Notification> pending(const QString &recipient);
+
+    /**
+     * @brief Drop the notifications of a recipient up to seq, delivered
+     */
+    void acknowledge(const QString &recipient, quint64 seq);
+
+    /**
+     * @brief Known recipients, the ones silent for too long being forgotten first
+     */
+    QStringList recipients();
+
+private:
+    struct Entry {
+        quint64 seq;
+        qint64 time;
+        QString message;
+    };
+
+    void expire(QList<Entry> &entries, qint64 now) const;
+    void expireRecipients(qint64 now);
+    bool compact();
+    void append(const QByteArray &record);
+
+    QHash<QString, QList<Entry>> m_queues;
+    QHash<QString, qint64> m_lastSeen;      // recipient -> ms since epoch
+    QFile m_store;
+    quint64 m_nextSeq {1};
+    qint64 m_maxSize {1024 * 1024};
+    qint64 m_ttl {24 * 3600 * 1000};
+    int m_maxPerRecipient {100};
+};
+
+#endif // KAZANOTIFICATIONQUEUE_H
@@ -14,15 +14,20 @@ KaZaObject::KaZaObject(const QString &name, QObject *parent)
     kaZaRegisterObject(this);
 }
 
+KaZaObject::~KaZaObject()
+{
+    kaZaUnregisterObject(this);
+}
+
 QString KaZaObject::name() const {
     return m_name;
 }
 
 void KaZaObject::setName(const QString &newName) {
-    if(m_name != newName) {
-        m_name = newName;
-        emit nameChanged();
-    }
+    if(m_name == newName)
+        return;
+    m_name = newName;
+    emit nameChanged();
     kaZaRegisterObject(this);
 }
 
@@ -15,12 +15,16 @@ class KaZaObject : public QObject
 public:
     explicit KaZaObject(QObject *parent = nullptr);
     explicit KaZaObject(const QString &name, QObject *parent = nullptr);
+    ~KaZaObject() override;
 
     virtual QVariant value() const;
     virtual void setValue(QVariant);
     virtual void changeValue(QVariant, bool confirm = false);
 
     QString name() const;
+    /**
+     * @brief Rename the object, the server reverts a name already in use
+     */
     void setName(const QString &newName);
 
     QString unit() const;
@@ -40,5 +44,6 @@ private:
 };
 
 extern void kaZaRegisterObject(KaZaObject *obj);
+extern void kaZaUnregisterObject(KaZaObject *obj);
 
 #endif // KAZAOBJECT_H
@@ -0,0 +1,244 @@
+#include "kazaobjectregistry.h"
+#include "kazaobject.h"
+#include <QDebug>
+#include <QSaveFile>
+#include <algorithm>
+
+bool KaZaObjectRegistry::load(const QString &path, int keepStarts)
+{
+    m_store.setFileName(path);
+    quint32 lastStart = 0;
+    QHash<quint16, QString> owners;
+    if(m_store.open(QFile::ReadOnly))
+    {
+        while(!m_store.atEnd())
+        {
+            const QByteArray line = m_store.readLine().trimmed();
+            const QList<QByteArray> fields = line.split('\t');
+            if(fields.size() == 2 && fields[0] == "S")
+            {
+                lastStart = qMax(lastStart, fields[1].toUInt());
+                continue;
+            }
+            if(fields.size() < 2) continue;
+
+            bool ok = false;
+            const uint id = fields[0].toUInt(&ok);
+            const QString name = QString::fromUtf8(fields[1]);
+            if(!ok || id > 0xFFFF || name.isEmpty())
+            {
+                qWarning().noquote() << "Ignoring invalid object id entry:" << line;
+                continue;
+            }
+            // Entries written before start records are taken as seen at the last start
+            const quint32 start = fields.size() > 2 ? fields[2].toUInt() : lastStart;
+            // A reclaimed id may have been given to another name since: the last record wins
+            const QString previous = owners.value(id);
+            if(!previous.isEmpty() && previous != name)
+            {
+                m_ids.remove(previous);
+            }
+            auto it = m_ids.constFind(name);
+            if(it != m_ids.cend() && it->id != id)
+            {
+                owners.remove(it->id);
+            }
+            owners.insert(id, name);
+            m_ids.insert(name, Assignment{quint16(id), start});
+        }
+        m_store.close();
+    }
+    m_start = lastStart + 1;
+
+    // Reclaim the ids of names not registered during the last starts
+    qsizetype reclaimed = 0;
+    for(auto it = m_ids.begin(); it != m_ids.end();)
+    {
+        if(it->start < m_start && m_start - it->start > quint32(qMax(1, keepStarts)))
+        {
+            it = m_ids.erase(it);
+            reclaimed++;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    QList<bool> used;
+    for(const Assignment &assignment: std::as_const(m_ids))
+    {
+        if(assignment.id >= used.size())
+        {
+            used.resize(assignment.id + 1, false);
+        }
+        used[assignment.id] = true;
+    }
+    m_nextId = used.size();
+    for(qsizetype id = 0; id < used.size(); ++id)
+    {
+        if(!used[id]) m_freeIds.append(id);
+    }
+    qInfo() << "Loaded" << m_ids.size() << "object ids from" << path << "," << reclaimed << "reclaimed";
+
+    // Start from a store holding only the kept assignments
+    QSaveFile out(path);
+    if(out.open(QFile::WriteOnly))
+    {
+        out.write("S\t" + QByteArray::number(m_start) + '\n');
+        for(auto it = m_ids.cbegin(); it != m_ids.cend(); ++it)
+        {
+            out.write(QByteArray::number(it->id) + '\t' + it.key().toUtf8() + '\t' + QByteArray::number(it->start) + '\n');
+        }
+        out.commit();
+    }
+
+    if(!m_store.open(QFile::WriteOnly | QFile::Append))
+    {
+        qWarning() << "Can't open object id store" << path << ":" << m_store.errorString();
+        return false;
+    }
+    return true;
+}
+
+void KaZaObjectRegistry::write(const QString &name, const Assignment &assignment)
+{
+    if(m_store.isOpen())
+    {
+        m_store.write(QByteArray::number(assignment.id) + '\t' + name.toUtf8() + '\t' + QByteArray::number(assignment.start) + '\n');
+        m_store.flush();
+    }
+}
+
+void KaZaObjectRegistry::releaseId(quint16 id)
+{
+    m_freeIds.insert(std::lower_bound(m_freeIds.begin(), m_freeIds.end(), id), id);
+}
+
+bool KaZaObjectRegistry::reclaimIds()
+{
+    // Names not registered since this start: their objects are not there
+    bool reclaimed = false;
+    for(auto it = m_ids.begin(); it != m_ids.end();)
+    {
+        if(it->start < m_start && !m_byName.contains(it.key()))
+        {
+            releaseId(it->id);
+            it = m_ids.erase(it);
+            reclaimed = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    return reclaimed;
+}
+
+qint32 KaZaObjectRegistry::assignId(const QString &name)
+{
+    auto it = m_ids.find(name);
+    if(it != m_ids.end())
+    {
+        if(it->start != m_start)
+        {
+            it->start = m_start;
+            write(name, it.value());
+        }
+        return it->id;
+    }
+    if(m_freeIds.isEmpty() && m_nextId > 0xFFFF && !reclaimIds())
+    {
+        qWarning().noquote() << "No object id left for" << name;
+        return InvalidId;
+    }
+
+    // Reuse the lowest reclaimed id to keep the table dense
+    const quint16 id = m_freeIds.isEmpty() ? quint16(m_nextId++) : m_freeIds.takeFirst();
+    const Assignment assignment{id, m_start};
+    m_ids.insert(name, assignment);
+    write(name, assignment);
+    return id;
+}
+
+bool KaZaObjectRegistry::insert(KaZaObject *obj)
+{
+    if(!obj) return false;
+
+    const QString name = obj->name();
+    if(name.isEmpty()) return false;
+
+    KaZaObject *owner = m_byName.value(name, nullptr);
+    if(owner && owner != obj)
+    {
+        qWarning().noquote() << "Duplicate object name" << name << ", keeping the first registered object";
+        return false;
+    }
+
+    auto it = m_entries.constFind(obj);
+    if(it != m_entries.cend() && it->name == name)
+    {
+        return true; // Already registered under this name
+    }
+
+    const qint32 id = assignId(name);
+    if(id == InvalidId) return false;
+
+    if(it != m_entries.cend())
+    {
+        // Rename: the id belongs to the name, register again under the new one
+        remove(obj);
+    }
+
+    if(id >= m_table.size())
+    {
+        m_table.resize(id + 1);
+    }
+    m_table[id] = obj;
+    m_entries.insert(obj, Entry{name, quint16(id)});
+    m_byName.insert(name, obj);
+    m_trie.insert(name, obj);
+    return true;
+}
+
+bool KaZaObjectRegistry::remove(KaZaObject *obj)
+{
+    auto it = m_entries.find(obj);
+    if(it == m_entries.end()) return false;
+
+    m_byName.remove(it->name);
+    m_trie.remove(it->name);
+    m_table[it->id] = nullptr;
+    m_entries.erase(it);
+    return true;
+}
+
+KaZaObject *KaZaObjectRegistry::object(const QString &name) const
+{
+    return m_byName.value(name, nullptr);
+}
+
+bool KaZaObjectRegistry::contains(const KaZaObject *obj) const
+{
+    return m_entries.contains(obj);
+}
+
+qint32 KaZaObjectRegistry::id(const KaZaObject *obj) const
+{
+    auto it = m_entries.constFind(obj);
+    if(it == m_entries.cend()) return InvalidId;
+    return it->id;
+}
+
+QStringList KaZaObjectRegistry::keys() const
+{
+    QStringList res;
+    res.reserve(m_byName.size());
+    for(const KaZaObject *obj: m_table)
+    {
+        if(obj)
+        {
+            res.append(m_entries[obj].name);
+        }
+    }
+    return res;
+}
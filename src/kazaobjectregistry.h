@@ -0,0 +1,118 @@
+#ifndef KAZAOBJECTREGISTRY_H
+#define KAZAOBJECTREGISTRY_H
+
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include "kazanametrie.h"
+
+class KaZaObject;
+
+/**
+ * @brief Name index of every KaZaObject known by the server
+ *
+ * Every registered object gets a compact numeric id. Ids are attached to the
+ * object name and persisted in an append-only store, so an object keeps its
+ * id across restarts and the id table stays dense. A removed object leaves an
+ * empty entry so the id of every other object stays stable. The name hash
+ * shares the QString registered for each object, so a name is only stored
+ * once whatever the number of lookups.
+ *
+ * The id of a name not registered during the last starts is reclaimed at
+ * load, and reused by the next new name; when no id is left, the ids of names
+ * not registered since this start are reclaimed as well.
+ *
+ * Lookup, registration and unregistration are O(1).
+ */
+class KaZaObjectRegistry
+{
+public:
+    static constexpr qint32 InvalidId = -1;
+
+    /**
+     * @brief Load persisted name to id assignments and open the store for appends
+     *
+     * Store format, one record per line:
+     * - "S\t<start>": server start, counted from 1
+     * - "<id>\t<name>[\t<start>]": assignment, name registered at that start
+     *
+     * The store is rewritten at load without the reclaimed names.
+     *
+     * @param path Store file (e.g., /var/lib/kazad/objects.ids)
+     * @param keepStarts Number of starts the id of a name not registered is kept
+     * @return false if the store can't be opened, ids are then only kept in memory
+     */
+    bool load(const QString &path, int keepStarts = 10);
+
+    /**
+     * @brief Register an object, or re-key it after a rename
+     *
+     * A rejected rename leaves the object registered under its previous name.
+     *
+     * @return false if the name is empty, already used by another object, or no id is left
+     */
+    bool insert(KaZaObject *obj);
+
+    /**
+     * @brief Remove an object from the registry
+     * @return false if the object was not registered
+     */
+    bool remove(KaZaObject *obj);
+
+    KaZaObject *object(const QString &name) const;
+    KaZaObject *object(quint16 id) const { return id < m_table.size() ? m_table[id] : nullptr; }
+    bool contains(const KaZaObject *obj) const;
+
+    /**
+     * @brief Id of a registered object, InvalidId if unknown
+     */
+    qint32 id(const KaZaObject *obj) const;
+
+    /**
+     * @brief Name a registered object is indexed under, empty if unknown
+     */
+    QString name(const KaZaObject *obj) const { return m_entries.value(obj).name; }
+
+    /**
+     * @brief Object table indexed by id (may contain nullptr holes)
+     */
+    const QList<KaZaObject*> &table() const { return m_table; }
+
+    /**
+     * @brief Registered objects whose name matches a dotted wildcard pattern
+     */
+    QList<KaZaObject*> match(const KaZaNamePattern &pattern) const { return m_trie.match(pattern); }
+
+    QStringList keys() const;
+    qsizetype size() const { return m_byName.size(); }
+
+private:
+    struct Entry {
+        QString name;
+        quint16 id;
+    };
+
+    struct Assignment {
+        quint16 id;
+        quint32 start;              // last start the name was registered at
+    };
+
+    qint32 assignId(const QString &name);
+    void releaseId(quint16 id);
+    bool reclaimIds();
+    void write(const QString &name, const Assignment &assignment);
+
+    QHash<QString, KaZaObject*> m_byName;
+    QHash<const KaZaObject*, Entry> m_entries;
+    QHash<QString, Assignment> m_ids;
+    QList<quint16> m_freeIds;       // reclaimed ids, ascending
+    QList<KaZaObject*> m_table;
+    quint32 m_nextId {0};
+    quint32 m_start {1};
+    QFile m_store;
+    KaZaNameTrie m_trie;
+};
+
+#endif // KAZAOBJECTREGISTRY_H
@@ -1,10 +1,15 @@
 #include "kazaremoteconnection.h"
 #include "kazamanager.h"
 #include "kazaobject.h"
+#include "kazaconnection.h"
 #include "kazacertificategenerator.h"
 #include <QTcpSocket>
 #include <QFile>
 #include <QSettings>
+#include <QThreadPool>
+#include <QCoreApplication>
+
+QHash<QString, QList<QPointer<KaZaRemoteConnection>>> KaZaRemoteConnection::m_generating;
 
 KaZaRemoteConnection::KaZaRemoteConnection(QTcpSocket *socket, QObject *parent)
     : QObject{parent}
@@ -88,27 +93,65 @@ void KaZaRemoteConnection::_processPacket(const QByteArray &packet) {
             return;
         }
 
-        QStringList lst = KaZaManager::getObjectKeys();
-        for(QString &key: lst)
+        for(KaZaObject *obj: KaZaManager::objects())
         {
-            KaZaObject *obj = KaZaManager::getObject(key);
             if(obj)
             {
-                QString line = key.leftJustified(80, ' ');
+                QString line = obj->name().leftJustified(80, ' ');
                 line.append(obj->value().toString());
                 line.append(" ");
                 line.append(obj->unit());
                 m_socket->write(line.toUtf8());
                 m_socket->write("\n");
             }
-            else
-            {
-                qWarning().noquote().nospace() << "[CTRL][" << id() << "]: Object in key list but not found: " << key;
-            }
         }
         m_socket->write("\n");
     }
 
+    if(cmd.startsWith("conn?"))
+    {
+        // Outbound queue state of every client connection
+        for(KaZaConnection *conn: KaZaManager::connections())
+        {
+            QString line = conn->idlog().leftJustified(60, ' ');
+            line.append(QString("subscriptions=%1 queued_bytes=%2 pending_updates=%3 collapsed_updates=%4")
+                            .arg(conn->subscriptionCount())
+                            .arg(conn->outboundBytes())
+                            .arg(conn->pendingUpdates())
+                            .arg(conn->collapsedUpdates()));
+            m_socket->write(line.toUtf8());
+            m_socket->write("\n");
+        }
+        m_socket->write("\n");
+        return;
+    }
+
+    if(cmd.startsWith("tls?"))
+    {
+        // Full and resumed handshakes, and duration (including network round trips) of the SSL servers
+        const QList<QPair<QString, KaZaHandshakeStats>> servers = {
+            qMakePair(QString("server"), KaZaManager::serverHandshakes()),
+            qMakePair(QString("control"), KaZaManager::controlHandshakes())
+        };
+        for(const auto &server: servers)
+        {
+            const KaZaHandshakeStats &stats = server.second;
+            QString line = server.first.leftJustified(10, ' ');
+            const quint64 resumed = qMin(stats.resumed, stats.completed);
+            line.append(QString("handshakes=%1 full=%2 resumed=%3 failed=%4 avg_duration_ms=%5 max_duration_ms=%6")
+                            .arg(stats.completed)
+                            .arg(stats.completed - resumed)
+                            .arg(resumed)
+                            .arg(stats.failed)
+                            .arg(stats.completed ? double(stats.totalNsecs) / stats.completed / 1000000.0 : 0.0, 0, 'f', 2)
+                            .arg(double(stats.maxNsecs) / 1000000.0, 0, 'f', 2));
+            m_socket->write(line.toUtf8());
+            m_socket->write("\n");
+        }
+        m_socket->write("\n");
+        return;
+    }
+
     if(cmd.startsWith("refresh"))
     {
         QStringList args = cmd.split(" ");
@@ -156,11 +199,9 @@ void KaZaRemoteConnection::__clientconf(const QString &adminPassword, const QStr
     QSettings settings("/etc/kazad.conf", QSettings::IniFormat);
     QString configPassword = settings.value("control/password").toString();
     QString hostname = settings.value("ssl/hostname").toString();
-    QString sslHost = settings.value("Client/host").toString();
-    if (sslHost.isEmpty()) {
-        sslHost = hostname; // Default to hostname if Client/host not set
-    }
-    QString sslPort = settings.value("ssl/port").toString();
+    // Clients lacking Ed25519 support can keep ECDSA keys under an Ed25519 CA
+    KaZaCertificateGenerator::KeyAlgorithm keyAlgorithm = KaZaCertificateGenerator::keyAlgorithm(
+        settings.value("ssl/clientkeyalgorithm", settings.value("ssl/keyalgorithm", "rsa")).toString());
 
     // Verify admin password
     if (adminPassword != configPassword) {
@@ -177,23 +218,63 @@ void KaZaRemoteConnection::__clientconf(const QString &adminPassword, const QStr
     QString clientCertPath = basePath + "/" + username + ".cert.pem";
     QString clientKeyPath = basePath + "/" + username + ".key";
 
+    // Certificate of this user already being generated: wait for it
+    auto pending = m_generating.find(username);
+    if (pending != m_generating.end()) {
+        qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Waiting for the client certificate being generated for user: " << username;
+        pending->append(this);
+        return;
+    }
+
     // Check if client certificate already exists
-    if (!QFile::exists(clientCertPath) || !QFile::exists(clientKeyPath)) {
-        qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Client certificate not found, generating for user: " << username;
+    if (QFile::exists(clientCertPath) && QFile::exists(clientKeyPath)) {
+        qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Using existing client certificate for user: " << username;
+        __sendClientConf(username);
+        return;
+    }
 
-        // Generate client certificate
-        if (!KaZaCertificateGenerator::generateClientCertificate(username, userPassword, hostname, basePath)) {
-            qCritical().noquote().nospace() << "[CTRL][" << id() << "]: Failed to generate client certificate for user: " << username;
-            m_socket->write("ERROR: Failed to generate client certificate\n");
-            m_socket->disconnectFromHost();
-            return;
-        }
+    qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Client certificate not found, generating for user: " << username;
 
-        qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Client certificate generated successfully for user: " << username;
-    } else {
-        qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Using existing client certificate for user: " << username;
+    // Key generation takes up to seconds: keep it out of the event loop
+    m_generating.insert(username, QList<QPointer<KaZaRemoteConnection>>() << this);
+    QThreadPool::globalInstance()->start([username, userPassword, hostname, basePath, keyAlgorithm]() {
+        bool generated = KaZaCertificateGenerator::generateClientCertificate(username, userPassword, hostname, basePath, keyAlgorithm);
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [generated, username]() {
+            const QList<QPointer<KaZaRemoteConnection>> waiting = m_generating.take(username);
+            for (const QPointer<KaZaRemoteConnection> &conn: waiting) {
+                if (conn) {
+                    conn->__clientconfReady(generated, username);
+                }
+            }
+        }, Qt::QueuedConnection);
+    });
+}
+
+void KaZaRemoteConnection::__clientconfReady(bool generated, const QString &username) {
+    if (!generated) {
+        qCritical().noquote().nospace() << "[CTRL][" << id() << "]: Failed to generate client certificate for user: " << username;
+        m_socket->write("ERROR: Failed to generate client certificate\n");
+        m_socket->disconnectFromHost();
+        return;
     }
 
+    qInfo().noquote().nospace() << "[CTRL][" << id() << "]: Client certificate generated successfully for user: " << username;
+    __sendClientConf(username);
+}
+
+void KaZaRemoteConnection::__sendClientConf(const QString &username) {
+    QSettings settings("/etc/kazad.conf", QSettings::IniFormat);
+    QString sslHost = settings.value("Client/host").toString();
+    if (sslHost.isEmpty()) {
+        sslHost = settings.value("ssl/hostname").toString(); // Default to hostname if Client/host not set
+    }
+    QString sslPort = settings.value("ssl/port").toString();
+
+    // Hardcoded paths
+    const QString basePath = "/var/lib/kazad";
+    QString clientCertPath = basePath + "/" + username + ".cert.pem";
+    QString clientKeyPath = basePath + "/" + username + ".key";
+
     // Send configuration as XML
     m_socket->write("<?xml version='1.0'?>\n");
     m_socket->write("<param>\n");
@@ -2,6 +2,8 @@
 #define KAZAREMOTECONNECTION_H
 
 #include <QObject>
+#include <QHash>
+#include <QPointer>
 class QTcpSocket;
 
 class KaZaRemoteConnection : public QObject
@@ -23,6 +25,11 @@ private slots:
 
 private:
     void __clientconf(const QString &adminPassword, const QString &username, const QString &userPassword);
+    void __clientconfReady(bool generated, const QString &username);
+    void __sendClientConf(const QString &username);
+
+    // Users whose certificate is being generated -> connections waiting for it
+    static QHash<QString, QList<QPointer<KaZaRemoteConnection>>> m_generating;
 
     void _disconnectFromHost();
 };
@@ -0,0 +1,169 @@
+#include "kazatlstickets.h"
+#include <QDebug>
+#include <QMutex>
+#include <cstring>
+
+#include <openssl/opensslv.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+namespace {
+
+struct TicketKey {
+    unsigned char name[16];
+    unsigned char aesKey[32];
+    unsigned char hmacKey[32];
+    bool valid {false};
+};
+
+/**
+ * @brief Keys of the contexts verifying the peer, or of the other ones
+ *
+ * A ticket issued without client certificate must never resume a session on
+ * a server requiring one: each kind of context has its own keys.
+ */
+struct KeySet {
+    TicketKey current;
+    TicketKey previous;
+    quint64 resumed {0};
+};
+
+QMutex s_mutex;
+KeySet s_keys[2];               // [0]: peer not verified, [1]: peer verified
+int s_lifetime {0};
+bool s_installed {false};
+
+bool generateKey(TicketKey &key)
+{
+    key.valid = RAND_bytes(key.name, sizeof(key.name)) == 1
+            && RAND_bytes(key.aesKey, sizeof(key.aesKey)) == 1
+            && RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) == 1;
+    return key.valid;
+}
+
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+static int setMacKey(EVP_MAC_CTX *mac, TicketKey &key)
+{
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmacKey, sizeof(key.hmacKey)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+        OSSL_PARAM_construct_end()
+    };
+    return EVP_MAC_CTX_set_params(mac, params);
+}
+
+/**
+ * @brief Ticket encryption (enc = 1) and decryption (enc = 0)
+ *
+ * Returns 1 to accept a ticket, 2 to accept it and issue a new one with the
+ * current key, 0 to ignore it (full handshake), -1 on error.
+ */
+static int ticketKeyCallback(SSL *ssl, unsigned char keyName[16], unsigned char *iv,
+                             EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+{
+    QMutexLocker locker(&s_mutex);
+    KeySet &keys = s_keys[(SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER) ? 1 : 0];
+
+    if (enc) {
+        if (!keys.current.valid || RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+            return -1;
+        }
+        memcpy(keyName, keys.current.name, sizeof(keys.current.name));
+        if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, keys.current.aesKey, iv)
+                || !setMacKey(mac, keys.current)) {
+            return -1;
+        }
+        return 1;
+    }
+
+    TicketKey *key = nullptr;
+    if (keys.current.valid && memcmp(keyName, keys.current.name, sizeof(keys.current.name)) == 0) {
+        key = &keys.current;
+    } else if (keys.previous.valid && memcmp(keyName, keys.previous.name, sizeof(keys.previous.name)) == 0) {
+        key = &keys.previous;
+    }
+    if (!key) {
+        return 0; // Expired key or other kind of server
+    }
+    if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key->aesKey, iv)
+            || !setMacKey(mac, *key)) {
+        return -1;
+    }
+    keys.resumed++;
+    return key == &keys.current ? 1 : 2;
+}
+
+/**
+ * @brief Called by OpenSSL for every new context, before Qt configures it
+ */
+static void contextCreated(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    SSL_CTX *ctx = static_cast<SSL_CTX*>(parent);
+    // The session id context is checked on resumption and is required with
+    // client certificates: the same for every context
+    static const unsigned char sessionContext[] = "kazad";
+    SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+    // A session lives as long as the key its ticket is encrypted with
+    SSL_CTX_set_timeout(ctx, 2 * s_lifetime);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketKeyCallback);
+}
+
+#endif
+
+bool KaZaTlsTickets::install(int lifetime)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (s_installed) {
+        return true;
+    }
+    s_lifetime = qMax(60, lifetime);
+    {
+        QMutexLocker locker(&s_mutex);
+        if (!generateKey(s_keys[0].current) || !generateKey(s_keys[1].current)) {
+            qWarning() << "Can't generate TLS ticket keys";
+            return false;
+        }
+    }
+    if (SSL_CTX_get_ex_new_index(0, nullptr, contextCreated, nullptr, nullptr) < 0) {
+        qWarning() << "Can't install TLS ticket keys";
+        return false;
+    }
+    s_installed = true;
+    return true;
+#else
+    Q_UNUSED(lifetime);
+    qWarning() << "Shared TLS ticket keys need OpenSSL 3.0";
+    return false;
+#endif
+}
+
+void KaZaTlsTickets::rotate()
+{
+    QMutexLocker locker(&s_mutex);
+    if (!s_installed) {
+        return;
+    }
+    for (KeySet &keys : s_keys) {
+        TicketKey next;
+        if (!generateKey(next)) {
+            qWarning() << "Can't generate TLS ticket key, keeping the current one";
+            return;
+        }
+        keys.previous = keys.current;
+        keys.current = next;
+    }
+}
+
+quint64 KaZaTlsTickets::resumed(bool peerVerified)
+{
+    QMutexLocker locker(&s_mutex);
+    return s_keys[peerVerified ? 1 : 0].resumed;
+}
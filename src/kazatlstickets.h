@@ -0,0 +1,51 @@
+#ifndef KAZATLSTICKETS_H
+#define KAZATLSTICKETS_H
+
+#include <QtGlobal>
+
+/**
+ * @brief Shared TLS session ticket keys, using OpenSSL C API
+ *
+ * Qt builds a private OpenSSL context for every socket, each one with its own
+ * random ticket keys: a session ticket can never be resumed on a later
+ * connection. Once installed, every server context created by OpenSSL (hence
+ * by Qt) encrypts and decrypts tickets with the same keys, so a client that
+ * reconnects gets an abbreviated handshake, without any public key operation.
+ *
+ * Keys are rotated by rotate(): tickets issued with the previous key are
+ * still accepted (and renewed with the current one), so a ticket is valid for
+ * one to two rotation periods. Keys only live in memory: tickets don't
+ * survive a restart.
+ *
+ * Requires OpenSSL 3.0 (ticket callback with EVP_MAC).
+ */
+class KaZaTlsTickets
+{
+public:
+    /**
+     * @brief Use shared ticket keys in every OpenSSL context created from now on
+     *
+     * Must be called before the SSL servers accept connections.
+     *
+     * @param lifetime Rotation period in seconds
+     * @return false if OpenSSL doesn't support it, contexts then keep their own keys
+     */
+    static bool install(int lifetime);
+
+    /**
+     * @brief Generate a new current key, the current one is kept to decrypt
+     */
+    static void rotate();
+
+    /**
+     * @brief Number of handshakes resumed from a ticket
+     *
+     * Servers are told apart by their peer verification: the main server
+     * verifies client certificates, the control server does not.
+     *
+     * @param peerVerified Count the contexts verifying the peer, or the other ones
+     */
+    static quint64 resumed(bool peerVerified);
+};
+
+#endif // KAZATLSTICKETS_H